@@ -5,10 +5,80 @@
 #pragma once
 
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <iterator>
+#include <memory>
+#include <string>
 #include <type_traits>
 #include <tuple>
 #include <utility>
+#include <vector>
+#include <list>
+#include <forward_list>
+#include <new>
+#if __cplusplus >= 201703L
+#include <optional>
+#include <string_view>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// wraps a zero terminated string so that it gets sorted by its characters
+// instead of by its address. return it from the key function, like
+// ska_sort(begin, end, [](const char * str){ return ska_c_string{ str }; });
+struct ska_c_string
+{
+    const char * str;
+
+    char operator[](size_t index) const
+    {
+        return str[index];
+    }
+    bool operator<(const ska_c_string & other) const
+    {
+        return std::strcmp(str, other.str) < 0;
+    }
+    bool operator==(const ska_c_string & other) const
+    {
+        return std::strcmp(str, other.str) == 0;
+    }
+};
+
+// iterators of containers that keep their elements in fixed size arrays,
+// like std::deque, can specialize this so that the sort reaches elements
+// through the table of arrays instead of through iterator arithmetic.
+// chunk_size() is the number of elements per array, chunk_map(it) points
+// at the entry in the table for the array that holds *it, and
+// chunk_offset(it) is the position of *it in that array
+template<typename It, typename Enable = void>
+struct ska_chunked_iterator
+{
+    static constexpr bool value = false;
+};
+#ifdef __GLIBCXX__
+// the iterator of std::deque in libstdc++
+template<typename It>
+struct ska_chunked_iterator<It, decltype(void(std::declval<const It &>()._M_node), void(std::declval<const It &>()._M_first), void(It::_S_buffer_size()))>
+{
+    static constexpr bool value = true;
+
+    static size_t chunk_size()
+    {
+        return It::_S_buffer_size();
+    }
+    static auto chunk_map(const It & it)
+    {
+        return it._M_node;
+    }
+    static size_t chunk_offset(const It & it)
+    {
+        return it._M_cur - it._M_first;
+    }
+};
+#endif
 
 namespace detail
 {
@@ -476,7 +546,7 @@ struct RadixSorter<char32_t> : SizedRadixSorter<sizeof(char32_t)>
 {
 };
 template<typename K, typename V>
-struct RadixSorter<std::pair<K, V>>
+struct PairRadixSorter
 {
     template<typename It, typename OutIt, typename ExtractKey>
     static bool sort(It begin, It end, OutIt buffer_begin, ExtractKey && extract_key)
@@ -503,7 +573,7 @@ struct RadixSorter<std::pair<K, V>>
     static constexpr size_t pass_count = RadixSorter<K>::pass_count + RadixSorter<V>::pass_count;
 };
 template<typename K, typename V>
-struct RadixSorter<const std::pair<K, V> &>
+struct ConstRefPairRadixSorter
 {
     template<typename It, typename OutIt, typename ExtractKey>
     static bool sort(It begin, It end, OutIt buffer_begin, ExtractKey && extract_key)
@@ -597,7 +667,7 @@ struct TupleRadixSorter<I, I, const Tuple &>
 };
 
 template<typename... Args>
-struct RadixSorter<std::tuple<Args...>>
+struct TupleRadixSorterStarter
 {
     using SorterImpl = TupleRadixSorter<0, sizeof...(Args), std::tuple<Args...>>;
 
@@ -611,7 +681,7 @@ struct RadixSorter<std::tuple<Args...>>
 };
 
 template<typename... Args>
-struct RadixSorter<const std::tuple<Args...> &>
+struct ConstRefTupleRadixSorterStarter
 {
     using SorterImpl = TupleRadixSorter<0, sizeof...(Args), const std::tuple<Args...> &>;
 
@@ -624,6 +694,83 @@ struct RadixSorter<const std::tuple<Args...> &>
     static constexpr size_t pass_count = SorterImpl::pass_count;
 };
 
+inline std::uint64_t load_big_endian(const unsigned char * bytes)
+{
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    std::uint64_t word;
+    std::memcpy(&word, bytes, sizeof(word));
+    return __builtin_bswap64(word);
+#else
+    std::uint64_t word = 0;
+    for (int i = 0; i < 8; ++i)
+        word = (word << 8) | bytes[i];
+    return word;
+#endif
+}
+
+// N bytes, read as big endian words so that sorting them takes one level
+// per eight bytes. the last word is padded with zeros. FlipMask flips the
+// sign bit of every byte for signed chars, to match to_unsigned_or_bool
+template<size_t N, std::uint64_t FlipMask>
+struct FixedBytesWords
+{
+    const unsigned char * bytes;
+
+    static constexpr size_t num_words = (N + 7) / 8;
+
+    size_t size() const
+    {
+        return num_words;
+    }
+    std::uint64_t operator[](size_t index) const
+    {
+        size_t offset = index * 8;
+        if (offset + 8 <= N)
+            return load_big_endian(bytes + offset) ^ FlipMask;
+        std::uint64_t word = 0;
+        for (size_t i = offset; i < N; ++i)
+            word = (word << 8) | bytes[i];
+        return (word << (8 * (offset + 8 - N))) ^ FlipMask;
+    }
+    bool operator<(const FixedBytesWords & other) const
+    {
+        for (size_t i = 0; i < num_words; ++i)
+        {
+            std::uint64_t l = (*this)[i];
+            std::uint64_t r = other[i];
+            if (l != r)
+                return l < r;
+        }
+        return false;
+    }
+};
+
+template<typename T>
+struct FixedBytesFlipMask
+{
+    static constexpr std::uint64_t value = std::is_same<T, signed char>::value ? 0x8080808080808080ull : 0;
+};
+
+template<typename T, size_t N>
+using FixedBytesWordsFor = FixedBytesWords<N, FixedBytesFlipMask<T>::value>;
+
+template<typename T>
+using is_byte_type = std::integral_constant<bool, std::is_same<T, char>::value || std::is_same<T, unsigned char>::value || std::is_same<T, signed char>::value>;
+
+template<typename T, size_t N, typename = typename std::enable_if<is_byte_type<T>::value>::type>
+inline FixedBytesWordsFor<T, N> fixed_bytes_words(const std::array<T, N> & value)
+{
+    return { reinterpret_cast<const unsigned char *>(value.data()) };
+}
+template<typename T, size_t N, typename = typename std::enable_if<is_byte_type<T>::value>::type>
+inline FixedBytesWordsFor<T, N> fixed_bytes_words(const T (&value)[N])
+{
+    return { reinterpret_cast<const unsigned char *>(value) };
+}
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename It, typename ExtractKey>
+void inplace_radix_sort(It begin, It end, ExtractKey & extract_key);
+
 template<typename T, size_t S>
 struct RadixSorter<std::array<T, S>>
 {
@@ -649,6 +796,65 @@ struct RadixSorter<std::array<T, S>>
     static constexpr size_t pass_count = RadixSorter<T>::pass_count * S;
 };
 
+// sorts on the first eight bytes with one LSD pass set. if that leaves ties,
+// the tied runs get sorted on the full key. for hashes and digests the first
+// word is almost always distinct, so that is the only sort
+template<typename T, size_t S>
+struct FixedBytesRadixSorter
+{
+    template<typename It, typename OutIt, typename ExtractKey>
+    static bool sort(It begin, It end, OutIt buffer_begin, ExtractKey && extract_key)
+    {
+        auto first_word = [&](auto && o)
+        {
+            return fixed_bytes_words(extract_key(o))[0];
+        };
+        bool which = SizedRadixSorter<8>::sort(begin, end, buffer_begin, first_word);
+        if (S > 8)
+        {
+            if (which)
+                sort_tied_runs(buffer_begin, buffer_begin + (end - begin), first_word, extract_key);
+            else
+                sort_tied_runs(begin, end, first_word, extract_key);
+        }
+        return which;
+    }
+
+    static constexpr size_t pass_count = SizedRadixSorter<8>::pass_count;
+
+private:
+    template<typename It, typename FirstWord, typename ExtractKey>
+    static void sort_tied_runs(It begin, It end, FirstWord & first_word, ExtractKey & extract_key)
+    {
+        auto rest_key = [&](auto && o)
+        {
+            return fixed_bytes_words(extract_key(o));
+        };
+        for (It run_begin = begin; run_begin != end;)
+        {
+            std::uint64_t word = first_word(*run_begin);
+            It run_end = std::next(run_begin);
+            while (run_end != end && first_word(*run_end) == word)
+                ++run_end;
+            if (run_end - run_begin > 1)
+                inplace_radix_sort<128, 1024>(run_begin, run_end, rest_key);
+            run_begin = run_end;
+        }
+    }
+};
+template<size_t S>
+struct RadixSorter<std::array<unsigned char, S>> : FixedBytesRadixSorter<unsigned char, S>
+{
+};
+template<size_t S>
+struct RadixSorter<std::array<char, S>> : FixedBytesRadixSorter<char, S>
+{
+};
+template<size_t S>
+struct RadixSorter<std::array<signed char, S>> : FixedBytesRadixSorter<signed char, S>
+{
+};
+
 template<typename T>
 struct RadixSorter<const T> : RadixSorter<T>
 {
@@ -718,6 +924,25 @@ template<typename T>
 using has_subscript_operator = typename has_subscript_operator_impl<T>::type;
 
 
+template<typename T, typename Enable = void>
+struct UnsignedKey
+{
+    static constexpr bool value = false;
+};
+template<typename T>
+struct UnsignedKey<T, void_t<decltype(to_unsigned_or_bool(std::declval<T>()))>>
+{
+    static constexpr bool value = true;
+
+    using type = decltype(to_unsigned_or_bool(std::declval<T>()));
+
+    template<typename U>
+    static type get(U && value)
+    {
+        return to_unsigned_or_bool(value);
+    }
+};
+
 template<typename T>
 struct FallbackRadixSorter<T, void_t<decltype(to_unsigned_or_bool(std::declval<T>()))>>
     : RadixSorter<decltype(to_unsigned_or_bool(std::declval<T>()))>
@@ -783,633 +1008,3578 @@ inline It custom_std_partition(It begin, It end, F && func)
     return begin;
 }
 
-struct PartitionInfo
+// the in-place sorters keep one table of these per level of recursion.
+// most levels sort far fewer than 4 billion elements, and with smaller
+// counts the table takes up less of the L1 cache
+template<typename count_type>
+struct BasicPartitionInfo
 {
-    PartitionInfo()
+    BasicPartitionInfo()
         : count(0)
     {
     }
 
     union
     {
-        size_t count;
-        size_t offset;
+        count_type count;
+        count_type offset;
     };
-    size_t next_offset;
+    count_type next_offset;
 };
+using PartitionInfo = BasicPartitionInfo<size_t>;
 
-template<size_t>
-struct UnsignedForSize;
-template<>
-struct UnsignedForSize<1>
-{
-    typedef uint8_t type;
-};
-template<>
-struct UnsignedForSize<2>
-{
-    typedef uint16_t type;
-};
-template<>
-struct UnsignedForSize<4>
-{
-    typedef uint32_t type;
-};
-template<>
-struct UnsignedForSize<8>
-{
-    typedef uint64_t type;
-};
-template<typename T>
-struct SubKey;
-template<size_t Size>
-struct SizedSubKey
+// random access to the elements of a range by index. on a chunked
+// container every element gets found through the table of arrays. that's a
+// division by a constant instead of the checks that the iterator does to
+// find out whether it leaves its current array
+template<typename It, bool = ska_chunked_iterator<It>::value>
+struct ElementAccess
 {
-    template<typename T>
-    static auto sub_key(T && value, void *)
+    using reference = typename std::iterator_traits<It>::reference;
+
+    explicit ElementAccess(It begin)
+        : begin(begin)
     {
-        return to_unsigned_or_bool(value);
     }
 
-    typedef SubKey<void> next;
+    reference operator[](size_t index) const
+    {
+        return begin[index];
+    }
+    void swap(size_t lhs, size_t rhs) const
+    {
+        std::iter_swap(begin + lhs, begin + rhs);
+    }
+    template<typename T>
+    void move_out(size_t index, size_t count, T * out) const
+    {
+        std::move(begin + index, begin + index + count, out);
+    }
+    template<typename T>
+    void move_in(T * in, size_t count, size_t index) const
+    {
+        std::move(in, in + count, begin + index);
+    }
 
-    using sub_key_type = typename UnsignedForSize<Size>::type;
-};
-template<typename T>
-struct SubKey<const T> : SubKey<T>
-{
-};
-template<typename T>
-struct SubKey<T &> : SubKey<T>
-{
-};
-template<typename T>
-struct SubKey<T &&> : SubKey<T>
-{
-};
-template<typename T>
-struct SubKey<const T &> : SubKey<T>
-{
-};
-template<typename T>
-struct SubKey<const T &&> : SubKey<T>
-{
+    It begin;
 };
-template<typename T, typename Enable = void>
-struct FallbackSubKey
-    : SubKey<decltype(to_radix_sort_key(std::declval<T>()))>
+template<typename It>
+struct ElementAccess<It, true>
 {
-    using base = SubKey<decltype(to_radix_sort_key(std::declval<T>()))>;
+    using traits = ska_chunked_iterator<It>;
+    using reference = typename std::iterator_traits<It>::reference;
 
-    template<typename U>
-    static decltype(auto) sub_key(U && value, void * data)
+    explicit ElementAccess(const It & begin)
+        : map(traits::chunk_map(begin)), offset(traits::chunk_offset(begin))
     {
-        return base::sub_key(to_radix_sort_key(value), data);
     }
-};
-template<typename T>
-struct FallbackSubKey<T, void_t<decltype(to_unsigned_or_bool(std::declval<T>()))>>
-    : SubKey<decltype(to_unsigned_or_bool(std::declval<T>()))>
-{
-};
-template<typename T>
-struct SubKey : FallbackSubKey<T>
-{
-};
-template<>
-struct SubKey<bool>
-{
+
+    reference operator[](size_t index) const
+    {
+        index += offset;
+        return map[index / traits::chunk_size()][index % traits::chunk_size()];
+    }
+    void swap(size_t lhs, size_t rhs) const
+    {
+        using std::swap;
+        swap((*this)[lhs], (*this)[rhs]);
+    }
     template<typename T>
-    static bool sub_key(T && value, void *)
+    void move_out(size_t index, size_t count, T * out) const
     {
-        return value;
+        for_each_piece(index, count, [&](auto chunk_begin, size_t piece)
+        {
+            out = std::move(chunk_begin, chunk_begin + piece, out);
+        });
+    }
+    template<typename T>
+    void move_in(T * in, size_t count, size_t index) const
+    {
+        for_each_piece(index, count, [&](auto chunk_begin, size_t piece)
+        {
+            std::move(in, in + piece, chunk_begin);
+            in += piece;
+        });
+    }
+    template<typename Func>
+    void for_each_piece(size_t index, size_t count, Func && func) const
+    {
+        index += offset;
+        auto chunk = map + index / traits::chunk_size();
+        size_t chunk_offset = index % traits::chunk_size();
+        for (; count; ++chunk, chunk_offset = 0)
+        {
+            size_t piece = std::min(count, traits::chunk_size() - chunk_offset);
+            func(*chunk + chunk_offset, piece);
+            count -= piece;
+        }
     }
 
-    typedef SubKey<void> next;
-
-    using sub_key_type = bool;
-};
-template<>
-struct SubKey<void>;
-template<>
-struct SubKey<unsigned char> : SizedSubKey<sizeof(unsigned char)>
-{
-};
-template<>
-struct SubKey<unsigned short> : SizedSubKey<sizeof(unsigned short)>
-{
-};
-template<>
-struct SubKey<unsigned int> : SizedSubKey<sizeof(unsigned int)>
-{
-};
-template<>
-struct SubKey<unsigned long> : SizedSubKey<sizeof(unsigned long)>
-{
-};
-template<>
-struct SubKey<unsigned long long> : SizedSubKey<sizeof(unsigned long long)>
-{
+    decltype(traits::chunk_map(std::declval<const It &>())) map;
+    size_t offset;
 };
-template<typename T>
-struct SubKey<T *> : SizedSubKey<sizeof(T *)>
+
+// calls func once for every contiguous piece of [begin, end). on a
+// chunked container those are pointer ranges, otherwise it's the whole range
+template<typename It, typename Func>
+inline void for_each_chunk(It begin, It end, Func && func, std::false_type)
 {
-};
-template<typename F, typename S, typename Current>
-struct PairSecondSubKey : Current
+    func(begin, end);
+}
+template<typename It, typename Func>
+inline void for_each_chunk(It begin, It end, Func && func, std::true_type)
 {
-    static decltype(auto) sub_key(const std::pair<F, S> & value, void * sort_data)
+    using traits = ska_chunked_iterator<It>;
+    auto map = traits::chunk_map(begin);
+    size_t offset = traits::chunk_offset(begin);
+    for (size_t remaining = end - begin; remaining; ++map, offset = 0)
     {
-        return Current::sub_key(value.second, sort_data);
+        size_t in_chunk = std::min(remaining, traits::chunk_size() - offset);
+        func(*map + offset, *map + offset + in_chunk);
+        remaining -= in_chunk;
     }
+}
+template<typename It, typename Func>
+inline void for_each_chunk(It begin, It end, Func && func)
+{
+    for_each_chunk(begin, end, func, std::integral_constant<bool, ska_chunked_iterator<It>::value>());
+}
 
-    using next = typename std::conditional<std::is_same<SubKey<void>, typename Current::next>::value, SubKey<void>, PairSecondSubKey<F, S, typename Current::next>>::type;
-};
-template<typename F, typename S, typename Current>
-struct PairFirstSubKey : Current
+template<typename It, typename count_type, typename PartitionIndex, typename Classify>
+inline void swap_into_partitions(It begin, BasicPartitionInfo<count_type> * partitions, PartitionIndex * remaining_partitions, int num_partitions, Classify && classify, std::false_type)
 {
-    static decltype(auto) sub_key(const std::pair<F, S> & value, void * sort_data)
+    for (PartitionIndex * last_remaining = remaining_partitions + num_partitions, * end_partition = remaining_partitions + 1; last_remaining > end_partition;)
     {
-        return Current::sub_key(value.first, sort_data);
+        last_remaining = custom_std_partition(remaining_partitions, last_remaining, [&](PartitionIndex partition)
+        {
+            count_type & begin_offset = partitions[partition].offset;
+            count_type & end_offset = partitions[partition].next_offset;
+            if (begin_offset == end_offset)
+                return false;
+
+            unroll_loop_four_times(begin + begin_offset, end_offset - begin_offset, [partitions, begin, &classify](It it)
+            {
+                PartitionIndex this_partition = classify(*it);
+                count_type offset = partitions[this_partition].offset++;
+                std::iter_swap(it, begin + offset);
+            });
+            return begin_offset != end_offset;
+        });
     }
+}
+template<typename It, typename count_type, typename PartitionIndex, typename Classify>
+inline void swap_into_partitions(It begin, BasicPartitionInfo<count_type> * partitions, PartitionIndex * remaining_partitions, int num_partitions, Classify && classify, std::true_type)
+{
+    ElementAccess<It> elements(begin);
+    for (PartitionIndex * last_remaining = remaining_partitions + num_partitions, * end_partition = remaining_partitions + 1; last_remaining > end_partition;)
+    {
+        last_remaining = custom_std_partition(remaining_partitions, last_remaining, [&](PartitionIndex partition)
+        {
+            count_type & begin_offset = partitions[partition].offset;
+            count_type & end_offset = partitions[partition].next_offset;
+            if (begin_offset == end_offset)
+                return false;
 
-    using next = typename std::conditional<std::is_same<SubKey<void>, typename Current::next>::value, PairSecondSubKey<F, S, SubKey<S>>, PairFirstSubKey<F, S, typename Current::next>>::type;
+            for (count_type index = begin_offset, index_end = end_offset; index != index_end; ++index)
+            {
+                PartitionIndex this_partition = classify(elements[index]);
+                count_type offset = partitions[this_partition].offset++;
+                elements.swap(index, offset);
+            }
+            return begin_offset != end_offset;
+        });
+    }
+}
+template<typename It, typename count_type, typename PartitionIndex, typename Classify>
+inline void swap_into_partitions(It begin, BasicPartitionInfo<count_type> * partitions, PartitionIndex * remaining_partitions, int num_partitions, Classify && classify)
+{
+    swap_into_partitions(begin, partitions, remaining_partitions, num_partitions, classify, std::integral_constant<bool, ska_chunked_iterator<It>::value>());
+}
+
+// block based version of swap_into_partitions, like in IPS4o. the element
+// by element version jumps to a random partition for every swap, which on
+// a big range misses the cache almost every time. this one first sorts the
+// elements into one small buffer per partition and writes full buffers
+// back to the front of the range as blocks. then it moves the blocks to
+// their partitions, and at the end it fills the gaps at the edges of each
+// partition from the half full buffers. all of that reads and writes whole
+// blocks at a time, so most of the accesses are sequential
+static constexpr size_t BlockPartitionBytes = 1024;
+static constexpr std::ptrdiff_t BlockPartitionMinBytes = 4 * 1024 * 1024;
+
+template<typename It>
+struct CanBlockPartition
+{
+    using value_type = typename std::iterator_traits<It>::value_type;
+    static constexpr bool value = std::is_trivially_copyable<value_type>::value
+                               && std::is_trivially_default_constructible<value_type>::value
+                               && std::is_same<typename std::iterator_traits<It>::reference, value_type &>::value;
 };
-template<typename F, typename S>
-struct SubKey<std::pair<F, S>> : PairFirstSubKey<F, S, SubKey<F>>
+
+template<typename It, typename count_type, typename Classify, typename ClassifyFirst>
+void block_swap_into_partitions(It begin, It end, const BasicPartitionInfo<count_type> * partitions, Classify && classify, ClassifyFirst && classify_first)
+{
+    using T = typename std::iterator_traits<It>::value_type;
+    static constexpr size_t block_size = sizeof(T) >= BlockPartitionBytes ? 1 : BlockPartitionBytes / sizeof(T);
+    size_t num_elements = end - begin;
+    ElementAccess<It> elements(begin);
+    size_t bucket_begin[257];
+    bucket_begin[0] = 0;
+    for (int i = 0; i < 256; ++i)
+        bucket_begin[i + 1] = partitions[i].next_offset;
+    auto round_up = [](size_t offset)
+    {
+        return (offset + block_size - 1) / block_size * block_size;
+    };
+    std::unique_ptr<T[]> buffers(new T[(256 + 3) * block_size]);
+    T * swap_a = buffers.get() + 256 * block_size;
+    T * swap_b = swap_a + block_size;
+    T * overflow = swap_b + block_size;
+
+    size_t buffer_sizes[256] = {};
+    size_t write = 0;
+    for (size_t read = 0; read < num_elements; ++read)
+    {
+        uint8_t bucket = classify_first(elements[read]);
+        T * buffer = buffers.get() + bucket * block_size;
+        if (buffer_sizes[bucket] == block_size)
+        {
+            elements.move_in(buffer, block_size, write);
+            write += block_size;
+            buffer_sizes[bucket] = 0;
+        }
+        buffer[buffer_sizes[bucket]++] = std::move(elements[read]);
+    }
+
+    // every partition gets its blocks at the block aligned positions in
+    // its range. [write_pos, read_pos) are the blocks in that range that
+    // haven't been looked at yet. the last block of the last partition can
+    // stick out past the end, and goes to the overflow buffer instead
+    size_t write_pos[256];
+    size_t read_pos[256];
+    for (int i = 0; i < 256; ++i)
+    {
+        write_pos[i] = round_up(bucket_begin[i]);
+        read_pos[i] = std::max(write_pos[i], std::min(round_up(bucket_begin[i + 1]), write));
+    }
+    size_t overflow_pos = num_elements;
+    for (int i = 0; i < 256; ++i)
+    {
+        while (read_pos[i] > write_pos[i])
+        {
+            read_pos[i] -= block_size;
+            elements.move_out(read_pos[i], block_size, swap_a);
+            for (;;)
+            {
+                uint8_t target = classify(swap_a[0]);
+                while (write_pos[target] < read_pos[target] && classify(elements[write_pos[target]]) == target)
+                    write_pos[target] += block_size;
+                size_t pos = write_pos[target];
+                write_pos[target] += block_size;
+                if (pos < read_pos[target])
+                {
+                    elements.move_out(pos, block_size, swap_b);
+                    elements.move_in(swap_a, block_size, pos);
+                    std::swap(swap_a, swap_b);
+                }
+                else
+                {
+                    if (pos + block_size > num_elements)
+                    {
+                        std::move(swap_a, swap_a + block_size, overflow);
+                        overflow_pos = pos;
+                    }
+                    else
+                        elements.move_in(swap_a, block_size, pos);
+                    break;
+                }
+            }
+        }
+    }
+
+    // the blocks leave gaps at the start and the end of every partition,
+    // and the last block of a partition can stick out into the start of
+    // the next partition. the elements that stick out and the elements in
+    // the buffers go into the gaps. this has to go from front to back so
+    // that nothing gets overwritten before it's moved out
+    auto element_at = [&](size_t pos) -> T &
+    {
+        if (pos >= overflow_pos && pos < overflow_pos + block_size)
+            return overflow[pos - overflow_pos];
+        else
+            return elements[pos];
+    };
+    for (int i = 0; i < 256; ++i)
+    {
+        size_t bucket_end = bucket_begin[i + 1];
+        size_t blocks_begin = round_up(bucket_begin[i]);
+        size_t blocks_end = write_pos[i];
+        size_t first_gap_end = bucket_end;
+        size_t second_gap_begin = bucket_end;
+        size_t sticking_out_end = bucket_end;
+        if (blocks_end != blocks_begin)
+        {
+            first_gap_end = blocks_begin;
+            second_gap_begin = std::min(blocks_end, bucket_end);
+            sticking_out_end = std::max(blocks_end, bucket_end);
+            if (overflow_pos >= blocks_begin && overflow_pos < blocks_end)
+            {
+                for (size_t pos = overflow_pos; pos < bucket_end; ++pos)
+                    elements[pos] = std::move(overflow[pos - overflow_pos]);
+            }
+        }
+        size_t gap = bucket_begin[i];
+        auto fill_gap = [&](T & value)
+        {
+            if (gap == first_gap_end)
+                gap = second_gap_begin;
+            elements[gap] = std::move(value);
+            ++gap;
+        };
+        for (size_t pos = bucket_end; pos < sticking_out_end; ++pos)
+            fill_gap(element_at(pos));
+        T * buffer = buffers.get() + i * block_size;
+        for (T * it = buffer, * buffer_end = buffer + buffer_sizes[i]; it != buffer_end; ++it)
+            fill_gap(*it);
+    }
+}
+template<typename It, typename count_type, typename Classify, typename ClassifyFirst>
+inline bool block_swap_into_partitions(It begin, It end, const BasicPartitionInfo<count_type> * partitions, Classify && classify, ClassifyFirst && classify_first, std::true_type)
+{
+    if ((end - begin) * static_cast<std::ptrdiff_t>(sizeof(typename std::iterator_traits<It>::value_type)) < BlockPartitionMinBytes)
+        return false;
+    block_swap_into_partitions(begin, end, partitions, classify, classify_first);
+    return true;
+}
+template<typename It, typename count_type, typename Classify, typename ClassifyFirst>
+inline bool block_swap_into_partitions(It, It, const BasicPartitionInfo<count_type> *, Classify &&, ClassifyFirst &&, std::false_type)
+{
+    return false;
+}
+
+inline std::uint64_t fibonacci_hash(std::uint64_t key)
+{
+    return key * 0x9e3779b97f4a7c15ull;
+}
+
+// small open addressing hash table used to detect ranges that only
+// contain a handful of distinct keys. those can be sorted with one
+// counting pass and one swap pass instead of one pass per byte
+template<typename KeyType>
+struct DistinctKeyTable
+{
+    static constexpr int max_distinct = 32;
+    static constexpr int num_slots = 64;
+
+    DistinctKeyTable()
+    {
+        std::fill(slots, slots + num_slots, -1);
+    }
+
+    int find_or_insert(KeyType key)
+    {
+        for (size_t slot = hash(key);; slot = (slot + 1) % num_slots)
+        {
+            int index = slots[slot];
+            if (index < 0)
+            {
+                if (num_keys == max_distinct)
+                    return -1;
+                slots[slot] = static_cast<std::int8_t>(num_keys);
+                keys[num_keys] = key;
+                return num_keys++;
+            }
+            else if (keys[index] == key)
+                return index;
+        }
+    }
+    int find(KeyType key) const
+    {
+        for (size_t slot = hash(key);; slot = (slot + 1) % num_slots)
+        {
+            int index = slots[slot];
+            if (keys[index] == key)
+                return index;
+        }
+    }
+    void sorted_order(std::uint8_t * order) const
+    {
+        for (int i = 0; i < num_keys; ++i)
+            order[i] = static_cast<std::uint8_t>(i);
+        std::sort(order, order + num_keys, [&](std::uint8_t l, std::uint8_t r)
+        {
+            return keys[l] < keys[r];
+        });
+    }
+
+    KeyType keys[max_distinct];
+    std::int8_t slots[num_slots];
+    int num_keys = 0;
+
+private:
+    static size_t hash(KeyType key)
+    {
+        return static_cast<size_t>(fibonacci_hash(static_cast<std::uint64_t>(key)) >> 58);
+    }
+};
+
+template<typename KeyType, typename It, typename GetKey>
+bool sample_distinct_keys(It begin, std::ptrdiff_t num_elements, DistinctKeyTable<KeyType> & table, GetKey && get_key)
+{
+    static constexpr std::ptrdiff_t num_samples = 64;
+    if (num_elements <= num_samples)
+        return true;
+    std::ptrdiff_t step = num_elements / num_samples;
+    It it = begin;
+    for (std::ptrdiff_t i = 0; i < num_samples; ++i, it += step)
+    {
+        if (table.find_or_insert(get_key(*it)) < 0)
+            return false;
+    }
+    return table.num_keys <= DistinctKeyTable<KeyType>::max_distinct / 2;
+}
+
+template<typename KeyType, typename count_type, typename It, typename GetKey>
+bool count_distinct_keys(It begin, It end, std::ptrdiff_t num_elements, DistinctKeyTable<KeyType> & table, count_type * counts, GetKey && get_key)
+{
+    if (!sample_distinct_keys(begin, num_elements, table, get_key))
+        return false;
+    std::fill(counts, counts + DistinctKeyTable<KeyType>::max_distinct, count_type());
+    for (It it = begin; it != end; ++it)
+    {
+        int index = table.find_or_insert(get_key(*it));
+        if (index < 0)
+            return false;
+        ++counts[index];
+    }
+    return true;
+}
+
+// after this partitions[i].next_offset is the end of the elements with
+// the i-th smallest key in the table
+template<typename KeyType, typename count_type, typename It, typename GetKey>
+void swap_into_distinct_keys(It begin, const DistinctKeyTable<KeyType> & table, const count_type * counts, PartitionInfo * partitions, GetKey && get_key)
+{
+    using Table = DistinctKeyTable<KeyType>;
+    int num_partitions = table.num_keys;
+    std::uint8_t order[Table::max_distinct];
+    table.sorted_order(order);
+    std::uint8_t rank[Table::max_distinct];
+    std::uint8_t remaining_partitions[Table::max_distinct];
+    size_t total = 0;
+    for (int i = 0; i < num_partitions; ++i)
+    {
+        rank[order[i]] = static_cast<std::uint8_t>(i);
+        partitions[i].offset = total;
+        total += counts[order[i]];
+        partitions[i].next_offset = total;
+        remaining_partitions[i] = static_cast<std::uint8_t>(i);
+    }
+    swap_into_partitions(begin, partitions, remaining_partitions, num_partitions, [&](auto && elem)
+    {
+        return rank[table.find(get_key(elem))];
+    });
+}
+
+template<size_t>
+struct UnsignedForSize;
+template<>
+struct UnsignedForSize<1>
 {
+    typedef uint8_t type;
 };
-template<size_t Index, typename First, typename... More>
-struct TypeAt : TypeAt<Index - 1, More..., void>
+template<>
+struct UnsignedForSize<2>
 {
+    typedef uint16_t type;
 };
-template<typename First, typename... More>
-struct TypeAt<0, First, More...>
+template<>
+struct UnsignedForSize<4>
+{
+    typedef uint32_t type;
+};
+template<>
+struct UnsignedForSize<8>
+{
+    typedef uint64_t type;
+};
+template<>
+struct UnsignedForSize<3> : UnsignedForSize<4>
+{
+};
+template<>
+struct UnsignedForSize<5> : UnsignedForSize<8>
+{
+};
+template<>
+struct UnsignedForSize<6> : UnsignedForSize<8>
+{
+};
+template<>
+struct UnsignedForSize<7> : UnsignedForSize<8>
 {
-    typedef First type;
 };
 
-template<size_t Index, typename Current, typename First, typename... More>
-struct TupleSubKey;
-
-template<size_t Index, typename Next, typename First, typename... More>
-struct NextTupleSubKey
+// pairs and tuples of small keys get packed into one integer, with the
+// first member in the most significant bytes. that sorts them in one go
+// instead of one member after the other
+template<typename T, bool = UnsignedKey<T>::value>
+struct PackedMemberBytes
 {
-    using type = TupleSubKey<Index, Next, First, More...>;
+    static constexpr size_t value = 9;
 };
-template<size_t Index, typename First, typename Second, typename... More>
-struct NextTupleSubKey<Index, SubKey<void>, First, Second, More...>
+template<typename T>
+struct PackedMemberBytes<T, true>
 {
-    using type = TupleSubKey<Index + 1, SubKey<Second>, Second, More...>;
+    static constexpr size_t value = sizeof(typename UnsignedKey<T>::type);
 };
-template<size_t Index, typename First>
-struct NextTupleSubKey<Index, SubKey<void>, First>
+template<typename... T>
+struct PackedBytes
 {
-    using type = SubKey<void>;
+    static constexpr size_t value = 0;
+};
+template<typename T, typename... More>
+struct PackedBytes<T, More...>
+{
+    static constexpr size_t value = PackedMemberBytes<T>::value + PackedBytes<More...>::value;
 };
 
-template<size_t Index, typename Current, typename First, typename... More>
-struct TupleSubKey : Current
+template<typename T>
+inline std::uint64_t pack_member(std::uint64_t packed, const T & value)
+{
+    return (packed << (8 * PackedMemberBytes<T>::value)) | UnsignedKey<T>::get(value);
+}
+
+template<size_t Index, size_t Size>
+struct TuplePacker
 {
     template<typename Tuple>
-    static decltype(auto) sub_key(const Tuple & value, void * sort_data)
+    static std::uint64_t pack(const Tuple & value, std::uint64_t packed)
     {
-        return Current::sub_key(std::get<Index>(value), sort_data);
+        using Member = typename std::tuple_element<Index, Tuple>::type;
+        return TuplePacker<Index + 1, Size>::pack(value, pack_member<Member>(packed, std::get<Index>(value)));
     }
-
-    using next = typename NextTupleSubKey<Index, typename Current::next, First, More...>::type;
 };
-template<size_t Index, typename Current, typename First>
-struct TupleSubKey<Index, Current, First> : Current
+template<size_t Size>
+struct TuplePacker<Size, Size>
 {
     template<typename Tuple>
-    static decltype(auto) sub_key(const Tuple & value, void * sort_data)
+    static std::uint64_t pack(const Tuple &, std::uint64_t packed)
     {
-        return Current::sub_key(std::get<Index>(value), sort_data);
+        return packed;
     }
-
-    using next = typename NextTupleSubKey<Index, typename Current::next, First>::type;
 };
-template<typename First, typename... More>
-struct SubKey<std::tuple<First, More...>> : TupleSubKey<0, SubKey<First>, First, More...>
+
+// the sorter for a packed key that doesn't fill a whole 1, 2, 4 or 8 byte
+// integer only needs to look at the bytes that are used
+template<size_t NumBytes>
+struct PackedKeyBytes
 {
 };
 
-struct BaseListSortData
+template<size_t NumBytes>
+struct PackedKeyInfo
 {
-    size_t current_index;
-    size_t recursion_limit;
-    void * next_sort_data;
+    static constexpr bool value = NumBytes <= 8;
+    static constexpr bool is_full_width = NumBytes == 1 || NumBytes == 2 || NumBytes == 4 || NumBytes == 8;
+    using type = typename UnsignedForSize<value ? NumBytes : 8>::type;
+    using sub_key_type = typename std::conditional<is_full_width, type, PackedKeyBytes<NumBytes>>::type;
 };
-template<typename It, typename ExtractKey>
-struct ListSortData : BaseListSortData
+
+template<typename T>
+struct PackedKey
 {
-    void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *);
+    static constexpr bool value = false;
+    static constexpr bool is_full_width = false;
 };
-
-template<typename CurrentSubKey, typename T>
-struct ListElementSubKey : SubKey<typename std::decay<decltype(std::declval<T>()[0])>::type>
+template<typename F, typename S>
+struct PackedKey<std::pair<F, S>> : PackedKeyInfo<PackedBytes<F, S>::value>
 {
-    using base = SubKey<typename std::decay<decltype(std::declval<T>()[0])>::type>;
+    using base = PackedKeyInfo<PackedBytes<F, S>::value>;
 
-    using next = ListElementSubKey;
+    static typename base::type pack(const std::pair<F, S> & value)
+    {
+        return static_cast<typename base::type>(pack_member<S>(pack_member<F>(0, value.first), value.second));
+    }
+};
+template<typename First, typename Second, typename... More>
+struct PackedKey<std::tuple<First, Second, More...>> : PackedKeyInfo<PackedBytes<First, Second, More...>::value>
+{
+    using base = PackedKeyInfo<PackedBytes<First, Second, More...>::value>;
 
-    template<typename U>
-    static decltype(auto) sub_key(U && value, void * sort_data)
+    static typename base::type pack(const std::tuple<First, Second, More...> & value)
     {
-        BaseListSortData * list_sort_data = static_cast<BaseListSortData *>(sort_data);
-        const T & list = CurrentSubKey::sub_key(value, list_sort_data->next_sort_data);
-        return base::sub_key(list[list_sort_data->current_index], list_sort_data->next_sort_data);
+        return static_cast<typename base::type>(TuplePacker<0, 2 + sizeof...(More)>::pack(value, 0));
     }
 };
 
 template<typename T>
-struct ListSubKey
+struct UnsignedKey<T, typename std::enable_if<PackedKey<typename std::decay<T>::type>::value>::type>
 {
-    using next = SubKey<void>;
+    static constexpr bool value = true;
 
-    using sub_key_type = T;
+    using type = typename PackedKey<typename std::decay<T>::type>::type;
 
-    static const T & sub_key(const T & value, void *)
+    template<typename U>
+    static type get(U && value)
     {
-        return value;
+        return PackedKey<typename std::decay<T>::type>::pack(value);
     }
 };
 
 template<typename T>
-struct FallbackSubKey<T, typename std::enable_if<has_subscript_operator<T>::value>::type> : ListSubKey<T>
+struct PackedRadixSorter
 {
+    template<typename It, typename OutIt, typename ExtractKey>
+    static bool sort(It begin, It end, OutIt buffer_begin, ExtractKey && extract_key)
+    {
+        return SizedRadixSorter<sizeof(typename PackedKey<T>::type)>::sort(begin, end, buffer_begin, [&](auto && o)
+        {
+            return PackedKey<T>::pack(extract_key(o));
+        });
+    }
+
+    static constexpr size_t pass_count = SizedRadixSorter<sizeof(typename PackedKey<T>::type)>::pass_count;
 };
 
-template<typename It, typename ExtractKey>
-inline void StdSortFallback(It begin, It end, ExtractKey & extract_key)
+// the LSD sorter only packs keys that fill a whole integer. otherwise the
+// packed key would need more passes than sorting the members one by one
+template<typename K, typename V>
+struct RadixSorter<std::pair<K, V>>
+    : std::conditional<PackedKey<std::pair<K, V>>::is_full_width, PackedRadixSorter<std::pair<K, V>>, PairRadixSorter<K, V>>::type
 {
-    std::sort(begin, end, [&](auto && l, auto && r){ return extract_key(l) < extract_key(r); });
-}
-
-template<std::ptrdiff_t StdSortThreshold, typename It, typename ExtractKey>
-inline bool StdSortIfLessThanThreshold(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key)
+};
+template<typename K, typename V>
+struct RadixSorter<const std::pair<K, V> &>
+    : std::conditional<PackedKey<std::pair<K, V>>::is_full_width, PackedRadixSorter<std::pair<K, V>>, ConstRefPairRadixSorter<K, V>>::type
 {
-    if (num_elements <= 1)
-        return true;
-    if (num_elements >= StdSortThreshold)
-        return false;
-    StdSortFallback(begin, end, extract_key);
-    return true;
-}
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType = typename CurrentSubKey::sub_key_type>
-struct InplaceSorter;
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, size_t NumBytes, size_t Offset = 0>
-struct UnsignedInplaceSorter
+};
+template<typename... Args>
+struct RadixSorter<std::tuple<Args...>>
+    : std::conditional<PackedKey<std::tuple<Args...>>::is_full_width, PackedRadixSorter<std::tuple<Args...>>, TupleRadixSorterStarter<Args...>>::type
+{
+};
+template<typename... Args>
+struct RadixSorter<const std::tuple<Args...> &>
+    : std::conditional<PackedKey<std::tuple<Args...>>::is_full_width, PackedRadixSorter<std::tuple<Args...>>, ConstRefTupleRadixSorterStarter<Args...>>::type
+{
+};
+template<typename T>
+struct SubKey;
+template<size_t Size>
+struct SizedSubKey
 {
-    static constexpr size_t ShiftAmount = (((NumBytes - 1) - Offset) * 8);
     template<typename T>
-    inline static uint8_t current_byte(T && elem, void * sort_data)
+    static auto sub_key(T && value, void *)
     {
-        return CurrentSubKey::sub_key(elem, sort_data) >> ShiftAmount;
+        return to_unsigned_or_bool(value);
     }
-    template<typename It, typename ExtractKey>
+
+    typedef SubKey<void> next;
+
+    using sub_key_type = typename UnsignedForSize<Size>::type;
+};
+template<typename T>
+struct SubKey<const T> : SubKey<T>
+{
+};
+template<typename T>
+struct SubKey<T &> : SubKey<T>
+{
+};
+template<typename T>
+struct SubKey<T &&> : SubKey<T>
+{
+};
+template<typename T>
+struct SubKey<const T &> : SubKey<T>
+{
+};
+template<typename T>
+struct SubKey<const T &&> : SubKey<T>
+{
+};
+template<typename T, typename Enable = void>
+struct FallbackSubKey
+    : SubKey<decltype(to_radix_sort_key(std::declval<T>()))>
+{
+    using base = SubKey<decltype(to_radix_sort_key(std::declval<T>()))>;
+
+    template<typename U>
+    static decltype(auto) sub_key(U && value, void * data)
+    {
+        return base::sub_key(to_radix_sort_key(value), data);
+    }
+};
+template<typename T>
+struct FallbackSubKey<T, void_t<decltype(to_unsigned_or_bool(std::declval<T>()))>>
+    : SubKey<decltype(to_unsigned_or_bool(std::declval<T>()))>
+{
+};
+template<typename T>
+struct SubKey : FallbackSubKey<T>
+{
+};
+template<>
+struct SubKey<bool>
+{
+    template<typename T>
+    static bool sub_key(T && value, void *)
+    {
+        return value;
+    }
+
+    typedef SubKey<void> next;
+
+    using sub_key_type = bool;
+};
+template<>
+struct SubKey<void>;
+template<>
+struct SubKey<unsigned char> : SizedSubKey<sizeof(unsigned char)>
+{
+};
+template<>
+struct SubKey<unsigned short> : SizedSubKey<sizeof(unsigned short)>
+{
+};
+template<>
+struct SubKey<unsigned int> : SizedSubKey<sizeof(unsigned int)>
+{
+};
+template<>
+struct SubKey<unsigned long> : SizedSubKey<sizeof(unsigned long)>
+{
+};
+template<>
+struct SubKey<unsigned long long> : SizedSubKey<sizeof(unsigned long long)>
+{
+};
+template<typename T>
+struct SubKey<T *> : SizedSubKey<sizeof(T *)>
+{
+};
+template<typename F, typename S, typename Current>
+struct PairSecondSubKey : Current
+{
+    static decltype(auto) sub_key(const std::pair<F, S> & value, void * sort_data)
+    {
+        return Current::sub_key(value.second, sort_data);
+    }
+
+    using next = typename std::conditional<std::is_same<SubKey<void>, typename Current::next>::value, SubKey<void>, PairSecondSubKey<F, S, typename Current::next>>::type;
+};
+template<typename F, typename S, typename Current>
+struct PairFirstSubKey : Current
+{
+    static decltype(auto) sub_key(const std::pair<F, S> & value, void * sort_data)
+    {
+        return Current::sub_key(value.first, sort_data);
+    }
+
+    using next = typename std::conditional<std::is_same<SubKey<void>, typename Current::next>::value, PairSecondSubKey<F, S, SubKey<S>>, PairFirstSubKey<F, S, typename Current::next>>::type;
+};
+template<typename T>
+struct PackedSubKey
+{
+    using next = SubKey<void>;
+
+    using sub_key_type = typename PackedKey<T>::sub_key_type;
+
+    static typename PackedKey<T>::type sub_key(const T & value, void *)
+    {
+        return PackedKey<T>::pack(value);
+    }
+};
+template<typename F, typename S>
+struct SubKey<std::pair<F, S>>
+    : std::conditional<PackedKey<std::pair<F, S>>::value, PackedSubKey<std::pair<F, S>>, PairFirstSubKey<F, S, SubKey<F>>>::type
+{
+};
+template<size_t Index, typename First, typename... More>
+struct TypeAt : TypeAt<Index - 1, More..., void>
+{
+};
+template<typename First, typename... More>
+struct TypeAt<0, First, More...>
+{
+    typedef First type;
+};
+
+template<size_t Index, typename Current, typename First, typename... More>
+struct TupleSubKey;
+
+template<size_t Index, typename Next, typename First, typename... More>
+struct NextTupleSubKey
+{
+    using type = TupleSubKey<Index, Next, First, More...>;
+};
+template<size_t Index, typename First, typename Second, typename... More>
+struct NextTupleSubKey<Index, SubKey<void>, First, Second, More...>
+{
+    using type = TupleSubKey<Index + 1, SubKey<Second>, Second, More...>;
+};
+template<size_t Index, typename First>
+struct NextTupleSubKey<Index, SubKey<void>, First>
+{
+    using type = SubKey<void>;
+};
+
+template<size_t Index, typename Current, typename First, typename... More>
+struct TupleSubKey : Current
+{
+    template<typename Tuple>
+    static decltype(auto) sub_key(const Tuple & value, void * sort_data)
+    {
+        return Current::sub_key(std::get<Index>(value), sort_data);
+    }
+
+    using next = typename NextTupleSubKey<Index, typename Current::next, First, More...>::type;
+};
+template<size_t Index, typename Current, typename First>
+struct TupleSubKey<Index, Current, First> : Current
+{
+    template<typename Tuple>
+    static decltype(auto) sub_key(const Tuple & value, void * sort_data)
+    {
+        return Current::sub_key(std::get<Index>(value), sort_data);
+    }
+
+    using next = typename NextTupleSubKey<Index, typename Current::next, First>::type;
+};
+template<typename First, typename... More>
+struct SubKey<std::tuple<First, More...>>
+    : std::conditional<PackedKey<std::tuple<First, More...>>::value, PackedSubKey<std::tuple<First, More...>>, TupleSubKey<0, SubKey<First>, First, More...>>::type
+{
+};
+
+struct BaseListSortData
+{
+    size_t current_index;
+    size_t recursion_limit;
+    void * next_sort_data;
+};
+template<typename It, typename ExtractKey>
+struct ListSortData : BaseListSortData
+{
+    void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *);
+};
+
+template<typename CurrentSubKey, typename T>
+struct ListElementSubKey : SubKey<typename std::decay<decltype(std::declval<T>()[0])>::type>
+{
+    using base = SubKey<typename std::decay<decltype(std::declval<T>()[0])>::type>;
+
+    using next = ListElementSubKey;
+
+    template<typename U>
+    static decltype(auto) sub_key(U && value, void * sort_data)
+    {
+        BaseListSortData * list_sort_data = static_cast<BaseListSortData *>(sort_data);
+        const T & list = CurrentSubKey::sub_key(value, list_sort_data->next_sort_data);
+        return base::sub_key(list[list_sort_data->current_index], list_sort_data->next_sort_data);
+    }
+};
+
+template<typename T>
+struct ListSubKey
+{
+    using next = SubKey<void>;
+
+    using sub_key_type = T;
+
+    static const T & sub_key(const T & value, void *)
+    {
+        return value;
+    }
+};
+
+template<typename T>
+struct FallbackSubKey<T, typename std::enable_if<has_subscript_operator<T>::value>::type> : ListSubKey<T>
+{
+};
+
+// the bytes of a string without owning them. compares like memcmp, so it
+// sorts in the same order as std::string
+struct ByteStringView
+{
+    const unsigned char * bytes;
+    size_t length;
+
+    size_t size() const
+    {
+        return length;
+    }
+    const unsigned char * data() const
+    {
+        return bytes;
+    }
+    unsigned char operator[](size_t index) const
+    {
+        return bytes[index];
+    }
+    bool operator<(const ByteStringView & other) const
+    {
+        int compared = std::memcmp(bytes, other.bytes, std::min(length, other.length));
+        return compared < 0 || (compared == 0 && length < other.length);
+    }
+    bool operator==(const ByteStringView & other) const
+    {
+        return length == other.length && std::memcmp(bytes, other.bytes, length) == 0;
+    }
+    bool operator!=(const ByteStringView & other) const
+    {
+        return !(*this == other);
+    }
+};
+
+template<typename Traits, typename Allocator>
+inline ByteStringView to_byte_string_view(const std::basic_string<char, Traits, Allocator> & str)
+{
+    return { reinterpret_cast<const unsigned char *>(str.data()), str.size() };
+}
+inline ByteStringView to_byte_string_view(const char * str)
+{
+    return { reinterpret_cast<const unsigned char *>(str), std::strlen(str) };
+}
+inline ByteStringView to_byte_string_view(ska_c_string str)
+{
+    return to_byte_string_view(str.str);
+}
+#if __cplusplus >= 201703L
+template<typename Traits>
+inline ByteStringView to_byte_string_view(std::basic_string_view<char, Traits> str)
+{
+    return { reinterpret_cast<const unsigned char *>(str.data()), str.size() };
+}
+#endif
+
+// strings that are cheap to copy are returned by value from sub_key, so
+// that key functions can return them by value
+template<typename T>
+struct ListViewSubKey
+{
+    using next = SubKey<void>;
+
+    using sub_key_type = T;
+
+    static T sub_key(const T & value, void *)
+    {
+        return value;
+    }
+};
+
+template<>
+struct SubKey<ska_c_string> : ListViewSubKey<ska_c_string>
+{
+};
+template<>
+struct SubKey<ByteStringView> : ListViewSubKey<ByteStringView>
+{
+};
+#if __cplusplus >= 201703L
+template<typename Traits>
+struct SubKey<std::basic_string_view<char, Traits>> : ListViewSubKey<std::basic_string_view<char, Traits>>
+{
+};
+#endif
+
+// a string whose bytes get passed through a byte map when they are read,
+// so that the radix sort orders by the mapped bytes
+template<typename ByteMap>
+struct MappedByteStringView
+{
+    ByteStringView view;
+    const ByteMap * byte_map;
+
+    size_t size() const
+    {
+        return view.length;
+    }
+    unsigned char operator[](size_t index) const
+    {
+        return (*byte_map)(view.bytes[index]);
+    }
+    bool operator<(const MappedByteStringView & other) const
+    {
+        for (size_t i = 0, end = std::min(size(), other.size()); i < end; ++i)
+        {
+            unsigned char l = (*this)[i];
+            unsigned char r = other[i];
+            if (l != r)
+                return l < r;
+        }
+        return size() < other.size();
+    }
+};
+
+template<typename ByteMap>
+struct SubKey<MappedByteStringView<ByteMap>> : ListViewSubKey<MappedByteStringView<ByteMap>>
+{
+};
+
+template<size_t N, std::uint64_t FlipMask>
+struct SubKey<FixedBytesWords<N, FlipMask>> : ListViewSubKey<FixedBytesWords<N, FlipMask>>
+{
+};
+
+// fixed width byte keys like hashes go through the list sorter as lists of
+// eight byte words. it skips words that are the same in all keys
+template<typename T, size_t N>
+struct FixedBytesSubKey
+{
+    using next = SubKey<void>;
+
+    using sub_key_type = FixedBytesWordsFor<T, N>;
+
+    template<typename U>
+    static sub_key_type sub_key(const U & value, void *)
+    {
+        return fixed_bytes_words(value);
+    }
+};
+template<size_t N>
+struct SubKey<std::array<unsigned char, N>> : FixedBytesSubKey<unsigned char, N>
+{
+};
+template<size_t N>
+struct SubKey<std::array<char, N>> : FixedBytesSubKey<char, N>
+{
+};
+template<size_t N>
+struct SubKey<std::array<signed char, N>> : FixedBytesSubKey<signed char, N>
+{
+};
+template<size_t N>
+struct SubKey<unsigned char[N]> : FixedBytesSubKey<unsigned char, N>
+{
+};
+template<size_t N>
+struct SubKey<char[N]> : FixedBytesSubKey<char, N>
+{
+};
+template<size_t N>
+struct SubKey<signed char[N]> : FixedBytesSubKey<signed char, N>
+{
+};
+
+struct ByteTable
+{
+    const unsigned char * table;
+
+    unsigned char operator()(unsigned char c) const
+    {
+        return table[c];
+    }
+};
+
+// only touches A-Z. bytes of multi byte UTF-8 sequences are all >= 0x80,
+// so UTF-8 text stays intact
+struct AsciiCaseFold
+{
+    unsigned char operator()(unsigned char c) const
+    {
+        return static_cast<unsigned>(c - 'A') < 26u ? static_cast<unsigned char>(c + ('a' - 'A')) : c;
+    }
+};
+
+// how the list sorter finds the end of a list and the common prefix of two
+// lists. the generic version compares one element at a time
+template<typename T>
+struct GenericListAccess
+{
+    static size_t size(const T & list)
+    {
+        return list.size();
+    }
+    static bool ends_at(const T & list, size_t index)
+    {
+        return list.size() <= index;
+    }
+    // returns the first index in [index, limit) at which the lists differ,
+    // or limit. limit is never more than the size of l
+    template<typename ElementKey>
+    static size_t common_prefix(const T & l, const T & r, size_t index, size_t limit, ElementKey & element_key)
+    {
+        for (limit = std::min(limit, static_cast<size_t>(r.size())); index < limit; ++index)
+        {
+            if (element_key(l[index]) != element_key(r[index]))
+                break;
+        }
+        return index;
+    }
+};
+
+template<typename T>
+struct ListAccess : GenericListAccess<T>
+{
+};
+
+inline bool words_equal(const unsigned char * l, const unsigned char * r)
+{
+    std::uint64_t l_word;
+    std::uint64_t r_word;
+    std::memcpy(&l_word, l, sizeof(l_word));
+    std::memcpy(&r_word, r, sizeof(r_word));
+    return l_word == r_word;
+}
+
+inline size_t common_prefix_bytes(const unsigned char * l, const unsigned char * r, size_t index, size_t limit)
+{
+    for (; index + 8 <= limit && words_equal(l + index, r + index); index += 8)
+    {
+    }
+    while (index < limit && l[index] == r[index])
+        ++index;
+    return index;
+}
+
+template<typename T>
+struct ContiguousBytesListAccess : GenericListAccess<T>
+{
+    template<typename ElementKey>
+    static size_t common_prefix(const T & l, const T & r, size_t index, size_t limit, ElementKey &)
+    {
+        limit = std::min(limit, static_cast<size_t>(r.size()));
+        return common_prefix_bytes(reinterpret_cast<const unsigned char *>(l.data()), reinterpret_cast<const unsigned char *>(r.data()), index, limit);
+    }
+};
+
+template<typename Traits, typename Allocator>
+struct ListAccess<std::basic_string<char, Traits, Allocator>> : ContiguousBytesListAccess<std::basic_string<char, Traits, Allocator>>
+{
+};
+template<>
+struct ListAccess<ByteStringView> : ContiguousBytesListAccess<ByteStringView>
+{
+};
+#if __cplusplus >= 201703L
+template<typename Traits>
+struct ListAccess<std::basic_string_view<char, Traits>> : ContiguousBytesListAccess<std::basic_string_view<char, Traits>>
+{
+};
+#endif
+
+// reading a word past the terminator is fine on real hardware, but address
+// sanitizer reports it
+#ifndef SKA_SORT_READ_PAST_TERMINATOR
+#if defined(__SANITIZE_ADDRESS__)
+#define SKA_SORT_READ_PAST_TERMINATOR 0
+#elif defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define SKA_SORT_READ_PAST_TERMINATOR 0
+#endif
+#endif
+#endif
+#ifndef SKA_SORT_READ_PAST_TERMINATOR
+#define SKA_SORT_READ_PAST_TERMINATOR 1
+#endif
+
+template<>
+struct ListAccess<ska_c_string>
+{
+    static size_t size(const ska_c_string & list)
+    {
+        return std::strlen(list.str);
+    }
+    // only called for indices up to the length of the string, because
+    // the list sorter moves strings out of the way once they end
+    static bool ends_at(const ska_c_string & list, size_t index)
+    {
+        return list.str[index] == '\0';
+    }
+    // limit is at most the length of l, so only r can end early. if it does,
+    // the word with its terminator doesn't match l. a word of r is only read
+    // if it doesn't cross a page boundary, so we never touch a page that the
+    // string doesn't reach into
+    template<typename ElementKey>
+    static size_t common_prefix(const ska_c_string & l, const ska_c_string & r, size_t index, size_t limit, ElementKey &)
+    {
+        static constexpr std::uintptr_t page_size = 4096;
+        const unsigned char * l_bytes = reinterpret_cast<const unsigned char *>(l.str);
+        const unsigned char * r_bytes = reinterpret_cast<const unsigned char *>(r.str);
+        for (; SKA_SORT_READ_PAST_TERMINATOR && index + 8 <= limit; index += 8)
+        {
+            if (page_size - (reinterpret_cast<std::uintptr_t>(r_bytes + index) % page_size) >= 8)
+            {
+                if (!words_equal(l_bytes + index, r_bytes + index))
+                    break;
+            }
+            else
+            {
+                for (size_t i = index; i < index + 8; ++i)
+                {
+                    if (l_bytes[i] != r_bytes[i])
+                        return i;
+                }
+            }
+        }
+        while (index < limit && l_bytes[index] == r_bytes[index])
+            ++index;
+        return index;
+    }
+};
+
+template<typename L, typename R>
+inline bool sort_key_less(const L & l, const R & r)
+{
+    return l < r;
+}
+// byte arrays have to compare in the same order as the radix sort puts
+// them, and raw arrays would otherwise compare as pointers
+template<typename T, size_t N>
+inline auto sort_key_less(const std::array<T, N> & l, const std::array<T, N> & r) -> decltype(fixed_bytes_words(l) < fixed_bytes_words(r))
+{
+    return fixed_bytes_words(l) < fixed_bytes_words(r);
+}
+template<typename T, size_t N>
+inline auto sort_key_less(const T (&l)[N], const T (&r)[N]) -> decltype(fixed_bytes_words(l) < fixed_bytes_words(r))
+{
+    return fixed_bytes_words(l) < fixed_bytes_words(r);
+}
+
+template<typename It, typename ExtractKey>
+inline void StdSortFallback(It begin, It end, ExtractKey & extract_key, std::false_type)
+{
+    std::sort(begin, end, [&](auto && l, auto && r){ return sort_key_less(extract_key(l), extract_key(r)); });
+}
+// most of the small ranges at the end of a sort on a chunked container lie
+// in one array, and those get sorted through pointers
+template<typename It, typename ExtractKey>
+inline void StdSortFallback(It begin, It end, ExtractKey & extract_key, std::true_type)
+{
+    using traits = ska_chunked_iterator<It>;
+    size_t num_elements = end - begin;
+    size_t offset = traits::chunk_offset(begin);
+    if (offset + num_elements <= traits::chunk_size())
+    {
+        auto chunk_begin = *traits::chunk_map(begin) + offset;
+        StdSortFallback(chunk_begin, chunk_begin + num_elements, extract_key, std::false_type());
+    }
+    else
+        StdSortFallback(begin, end, extract_key, std::false_type());
+}
+template<typename It, typename ExtractKey>
+inline void StdSortFallback(It begin, It end, ExtractKey & extract_key)
+{
+    StdSortFallback(begin, end, extract_key, std::integral_constant<bool, ska_chunked_iterator<It>::value>());
+}
+
+template<std::ptrdiff_t StdSortThreshold, typename It, typename ExtractKey>
+inline bool StdSortIfLessThanThreshold(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key)
+{
+    if (num_elements <= 1)
+        return true;
+    if (num_elements >= StdSortThreshold)
+        return false;
+    StdSortFallback(begin, end, extract_key);
+    return true;
+}
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType = typename CurrentSubKey::sub_key_type>
+struct InplaceSorter;
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, size_t NumBytes, size_t Offset = 0>
+struct UnsignedInplaceSorter
+{
+    static constexpr size_t ShiftAmount = (((NumBytes - 1) - Offset) * 8);
+    template<typename T>
+    inline static uint8_t current_byte(T && elem, void * sort_data)
+    {
+        return CurrentSubKey::sub_key(elem, sort_data) >> ShiftAmount;
+    }
+    // the histogram for the next byte, if the level above already counted it
+    template<typename It, typename ExtractKey>
+    static void sort_counted(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data, const size_t * counts)
+    {
+        if (num_elements < AmericanFlagSortThreshold)
+            american_flag_sort(begin, end, extract_key, next_sort, sort_data, counts);
+        else
+            ska_byte_sort(begin, end, extract_key, next_sort, sort_data, counts);
+    }
+
+    template<typename It, typename ExtractKey>
     static void sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data)
     {
-        if (num_elements < AmericanFlagSortThreshold)
-            american_flag_sort(begin, end, extract_key, next_sort, sort_data);
-        else
-            ska_byte_sort(begin, end, extract_key, next_sort, sort_data);
+        if (num_elements < AmericanFlagSortThreshold)
+            american_flag_sort(begin, end, extract_key, next_sort, sort_data);
+        else if (Offset != 0 || NumBytes == 1 || !low_cardinality_sort(begin, end, num_elements, extract_key, next_sort, sort_data))
+        {
+            using can_use_wide_digit = std::integral_constant<bool, Offset == 0 && NumBytes >= 2>;
+            if (!ska_wide_sort(begin, end, num_elements, extract_key, next_sort, sort_data, can_use_wide_digit()))
+                ska_byte_sort(begin, end, extract_key, next_sort, sort_data);
+        }
+    }
+
+    // on arrays that are much bigger than the cache every level of the sort
+    // is a trip to main memory. so the top level of those splits by more
+    // than one byte at once, which saves one of those trips. the digit gets
+    // wider as the array grows, but it stops at the width where the write
+    // positions of all partitions still fit in the cache. otherwise every
+    // swap is a cache miss and the wide level costs more than it saves
+    static constexpr std::ptrdiff_t WideDigitMinBytes = 64 * 1024 * 1024;
+    static constexpr std::ptrdiff_t WideDigitMinPartitionSize = 2048;
+    static constexpr int WideDigitMinBits = 9;
+    static constexpr int WideDigitMaxBits = 11;
+
+    static int wide_digit_bits(std::ptrdiff_t num_elements, size_t element_size)
+    {
+        if (num_elements * static_cast<std::ptrdiff_t>(element_size) < WideDigitMinBytes)
+            return 0;
+        int num_bits = 0;
+        while (num_bits < WideDigitMaxBits && (num_elements >> (num_bits + 1)) >= WideDigitMinPartitionSize)
+            ++num_bits;
+        return num_bits >= WideDigitMinBits ? num_bits : 0;
+    }
+
+    template<typename It, typename ExtractKey>
+    static bool ska_wide_sort(It, It, std::ptrdiff_t, ExtractKey &, void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *), void *, std::false_type)
+    {
+        return false;
+    }
+    // the levels after the wide one keep going byte by byte. the first of
+    // them looks at the byte that the wide digit ended in. the bits of that
+    // byte that were in the wide digit are the same for the whole partition,
+    // so that level splits into fewer partitions, but it's still correct
+    template<typename It, typename ExtractKey>
+    static bool ska_wide_sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data, std::true_type)
+    {
+        int num_bits = wide_digit_bits(num_elements, sizeof(typename std::iterator_traits<It>::value_type));
+        if (!num_bits)
+            return false;
+        size_t num_digits = size_t(1) << num_bits;
+        int shift = static_cast<int>(ShiftAmount) + 8 - num_bits;
+        auto current_digit = [&](auto && elem) -> uint16_t
+        {
+            return static_cast<uint16_t>(CurrentSubKey::sub_key(extract_key(elem), sort_data) >> shift);
+        };
+        std::unique_ptr<PartitionInfo[]> partitions(new PartitionInfo[num_digits]);
+        std::unique_ptr<uint16_t[]> remaining_partitions(new uint16_t[num_digits]);
+        for_each_chunk(begin, end, [&](auto chunk_begin, auto chunk_end)
+        {
+            for (auto it = chunk_begin; it != chunk_end; ++it)
+            {
+                ++partitions[current_digit(*it)].count;
+            }
+        });
+        size_t total = 0;
+        int num_partitions = 0;
+        for (size_t i = 0; i < num_digits; ++i)
+        {
+            size_t count = partitions[i].count;
+            if (count)
+            {
+                partitions[i].offset = total;
+                total += count;
+                remaining_partitions[num_partitions] = static_cast<uint16_t>(i);
+                ++num_partitions;
+            }
+            partitions[i].next_offset = total;
+        }
+        swap_into_partitions(begin, partitions.get(), remaining_partitions.get(), num_partitions, current_digit);
+        for (uint16_t * it = remaining_partitions.get() + num_partitions; it != remaining_partitions.get(); --it)
+        {
+            uint16_t partition = it[-1];
+            size_t start_offset = (partition == 0 ? 0 : partitions[partition - 1].next_offset);
+            size_t end_offset = partitions[partition].next_offset;
+            It partition_begin = begin + start_offset;
+            It partition_end = begin + end_offset;
+            std::ptrdiff_t num_elements = end_offset - start_offset;
+            if (!StdSortIfLessThanThreshold<StdSortThreshold>(partition_begin, partition_end, num_elements, extract_key))
+            {
+                UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, Offset + 1>::sort(partition_begin, partition_end, num_elements, extract_key, next_sort, sort_data);
+            }
+        }
+        return true;
+    }
+
+    template<typename It, typename ExtractKey>
+    static bool low_cardinality_sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data)
+    {
+        using KeyType = typename UnsignedForSize<NumBytes>::type;
+        using Table = DistinctKeyTable<KeyType>;
+        auto get_key = [&](auto && elem) -> KeyType
+        {
+            return CurrentSubKey::sub_key(extract_key(elem), sort_data);
+        };
+        Table table;
+        size_t counts[Table::max_distinct];
+        if (!count_distinct_keys(begin, end, num_elements, table, counts, get_key))
+            return false;
+        int num_partitions = table.num_keys;
+        PartitionInfo partitions[Table::max_distinct];
+        swap_into_distinct_keys(begin, table, counts, partitions, get_key);
+        if (next_sort)
+        {
+            size_t start_offset = 0;
+            It partition_begin = begin;
+            for (int i = 0; i < num_partitions; ++i)
+            {
+                size_t end_offset = partitions[i].next_offset;
+                It partition_end = begin + end_offset;
+                std::ptrdiff_t num_elements = end_offset - start_offset;
+                if (!StdSortIfLessThanThreshold<StdSortThreshold>(partition_begin, partition_end, num_elements, extract_key))
+                {
+                    next_sort(partition_begin, partition_end, num_elements, extract_key, sort_data);
+                }
+                start_offset = end_offset;
+                partition_begin = partition_end;
+            }
+        }
+        return true;
+    }
+
+    // american flag sort only runs on ranges that are smaller than the
+    // threshold, so usually 16 bit counts are enough
+    using AmericanFlagCountType = typename std::conditional<AmericanFlagSortThreshold <= (1 << 16), uint16_t, size_t>::type;
+
+    template<typename It, typename ExtractKey>
+    static void american_flag_sort(It begin, It end, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data, const size_t * counts = nullptr)
+    {
+        using count_type = AmericanFlagCountType;
+        BasicPartitionInfo<count_type> partitions[256];
+        count_partitions(begin, end, partitions, extract_key, sort_data, counts);
+        count_type total = 0;
+        uint8_t remaining_partitions[256];
+        int num_partitions = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            count_type count = partitions[i].count;
+            if (!count)
+                continue;
+            partitions[i].offset = total;
+            total += count;
+            partitions[i].next_offset = total;
+            remaining_partitions[num_partitions] = i;
+            ++num_partitions;
+        }
+        if (num_partitions > 1)
+        {
+            uint8_t * current_block_ptr = remaining_partitions;
+            BasicPartitionInfo<count_type> * current_block = partitions + *current_block_ptr;
+            uint8_t * last_block = remaining_partitions + num_partitions - 1;
+            ElementAccess<It> elements(begin);
+            size_t index = 0;
+            size_t block_end = current_block->next_offset;
+            size_t last_element = (end - begin) - 1;
+            for (;;)
+            {
+                BasicPartitionInfo<count_type> * block = partitions + current_byte(extract_key(elements[index]), sort_data);
+                if (block == current_block)
+                {
+                    ++index;
+                    if (index == last_element)
+                        break;
+                    else if (index == block_end)
+                    {
+                        for (;;)
+                        {
+                            ++current_block_ptr;
+                            if (current_block_ptr == last_block)
+                                goto recurse;
+                            current_block = partitions + *current_block_ptr;
+                            if (current_block->offset != current_block->next_offset)
+                                break;
+                        }
+
+                        index = current_block->offset;
+                        block_end = current_block->next_offset;
+                    }
+                }
+                else
+                {
+                    count_type offset = block->offset++;
+                    elements.swap(index, offset);
+                }
+            }
+        }
+        recurse:
+        if (Offset + 1 != NumBytes || next_sort)
+        {
+            size_t start_offset = 0;
+            It partition_begin = begin;
+            for (uint8_t * it = remaining_partitions, * end = remaining_partitions + num_partitions; it != end; ++it)
+            {
+                size_t end_offset = partitions[*it].next_offset;
+                It partition_end = begin + end_offset;
+                std::ptrdiff_t num_elements = end_offset - start_offset;
+                if (!StdSortIfLessThanThreshold<StdSortThreshold>(partition_begin, partition_end, num_elements, extract_key))
+                {
+                    UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, Offset + 1>::sort(partition_begin, partition_end, num_elements, extract_key, next_sort, sort_data);
+                }
+                start_offset = end_offset;
+                partition_begin = partition_end;
+            }
+        }
+    }
+
+    template<typename It, typename ExtractKey, typename count_type>
+    static void count_partitions(It begin, It end, BasicPartitionInfo<count_type> * partitions, ExtractKey & extract_key, void * sort_data, const size_t * counts)
+    {
+        if (counts)
+        {
+            for (int i = 0; i < 256; ++i)
+                partitions[i].count = static_cast<count_type>(counts[i]);
+        }
+        else
+        {
+            for_each_chunk(begin, end, [&](auto chunk_begin, auto chunk_end)
+            {
+                for (auto it = chunk_begin; it != chunk_end; ++it)
+                {
+                    ++partitions[current_byte(extract_key(*it), sort_data)].count;
+                }
+            });
+        }
+    }
+
+    // every element passes through a register when it gets put into its
+    // partition, so for big ranges that pass also counts the next byte for
+    // every partition. that way the next level doesn't have to read all of
+    // its elements one more time just to count them
+    static constexpr std::ptrdiff_t FusedHistogramMinElements = 1 << 20;
+    static constexpr size_t NextShiftAmount = ShiftAmount >= 8 ? ShiftAmount - 8 : 0;
+
+    static bool fuse_next_histogram(std::ptrdiff_t num_elements)
+    {
+        return Offset + 1 < NumBytes && num_elements >= FusedHistogramMinElements;
+    }
+
+    template<typename It, typename ExtractKey>
+    static void ska_byte_sort(It begin, It end, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data, const size_t * counts = nullptr)
+    {
+        std::ptrdiff_t num_elements = end - begin;
+        if (num_elements < (1ll << 32))
+            ska_byte_sort_impl<uint32_t>(begin, end, extract_key, next_sort, sort_data, counts);
+        else
+            ska_byte_sort_impl<size_t>(begin, end, extract_key, next_sort, sort_data, counts);
+    }
+
+    template<typename count_type, typename It, typename ExtractKey>
+    static void ska_byte_sort_impl(It begin, It end, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data, const size_t * counts)
+    {
+        BasicPartitionInfo<count_type> partitions[256];
+        count_partitions(begin, end, partitions, extract_key, sort_data, counts);
+        uint8_t remaining_partitions[256];
+        count_type total = 0;
+        int num_partitions = 0;
+        for (int i = 0; i < 256; ++i)
+        {
+            count_type count = partitions[i].count;
+            if (count)
+            {
+                partitions[i].offset = total;
+                total += count;
+                remaining_partitions[num_partitions] = i;
+                ++num_partitions;
+            }
+            partitions[i].next_offset = total;
+        }
+        std::unique_ptr<size_t[]> next_counts;
+        if (num_partitions > 1 && fuse_next_histogram(end - begin))
+            next_counts.reset(new size_t[256 * 256]());
+        size_t * next_counts_ptr = next_counts.get();
+        auto classify = [&](auto && elem)
+        {
+            return current_byte(extract_key(elem), sort_data);
+        };
+        auto classify_and_count = [&](auto && elem)
+        {
+            auto key = CurrentSubKey::sub_key(extract_key(elem), sort_data);
+            uint8_t partition = key >> ShiftAmount;
+            if (next_counts_ptr)
+                ++next_counts_ptr[partition * 256 + static_cast<uint8_t>(key >> NextShiftAmount)];
+            return partition;
+        };
+        if (num_partitions <= 1 || !block_swap_into_partitions(begin, end, partitions, classify, classify_and_count, std::integral_constant<bool, CanBlockPartition<It>::value>()))
+        {
+            swap_into_partitions(begin, partitions, remaining_partitions, num_partitions, classify_and_count);
+            // swap_into_partitions stops when only one partition is left,
+            // so the elements that were already in it never got counted
+            if (next_counts_ptr)
+            {
+                for (int i = 0; i < num_partitions; ++i)
+                {
+                    BasicPartitionInfo<count_type> & partition = partitions[remaining_partitions[i]];
+                    for (It it = begin + partition.offset, it_end = begin + partition.next_offset; it != it_end; ++it)
+                        classify_and_count(*it);
+                }
+            }
+        }
+        if (Offset + 1 != NumBytes || next_sort)
+        {
+            for (uint8_t * it = remaining_partitions + num_partitions; it != remaining_partitions; --it)
+            {
+                uint8_t partition = it[-1];
+                size_t start_offset = (partition == 0 ? 0 : partitions[partition - 1].next_offset);
+                size_t end_offset = partitions[partition].next_offset;
+                It partition_begin = begin + start_offset;
+                It partition_end = begin + end_offset;
+                std::ptrdiff_t num_elements = end_offset - start_offset;
+                if (StdSortIfLessThanThreshold<StdSortThreshold>(partition_begin, partition_end, num_elements, extract_key))
+                    continue;
+                if (next_counts_ptr)
+                    UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, Offset + 1>::sort_counted(partition_begin, partition_end, num_elements, extract_key, next_sort, sort_data, next_counts_ptr + partition * 256);
+                else
+                    UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, Offset + 1>::sort(partition_begin, partition_end, num_elements, extract_key, next_sort, sort_data);
+            }
+        }
+    }
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, size_t NumBytes>
+struct UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, NumBytes>
+{
+    template<typename It, typename ExtractKey>
+    inline static void sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * next_sort_data)
+    {
+        next_sort(begin, end, num_elements, extract_key, next_sort_data);
+    }
+    template<typename It, typename ExtractKey>
+    inline static void sort_counted(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * next_sort_data, const size_t *)
+    {
+        next_sort(begin, end, num_elements, extract_key, next_sort_data);
+    }
+};
+
+template<typename It, typename ExtractKey, typename ElementKey>
+size_t CommonPrefix(It begin, It end, size_t start_index, ExtractKey && extract_key, ElementKey && element_key)
+{
+    const auto & largest_match_list = extract_key(*begin);
+    using Access = ListAccess<typename std::decay<decltype(largest_match_list)>::type>;
+    size_t largest_match = Access::size(largest_match_list);
+    if (largest_match == start_index)
+        return start_index;
+    for (++begin; begin != end; ++begin)
+    {
+        largest_match = Access::common_prefix(largest_match_list, extract_key(*begin), start_index, largest_match, element_key);
+        if (largest_match == start_index)
+            return start_index;
+    }
+    return largest_match;
+}
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename ListType>
+struct ListInplaceSorter
+{
+    using ElementSubKey = ListElementSubKey<CurrentSubKey, ListType>;
+    template<typename It, typename ExtractKey>
+    static void sort(It begin, It end, ExtractKey & extract_key, ListSortData<It, ExtractKey> * sort_data)
+    {
+        size_t current_index = sort_data->current_index;
+        void * next_sort_data = sort_data->next_sort_data;
+        auto current_key = [&](auto && elem) -> decltype(auto)
+        {
+            return CurrentSubKey::sub_key(extract_key(elem), next_sort_data);
+        };
+        auto element_key = [&](auto && elem) -> decltype(auto)
+        {
+            return ElementSubKey::base::sub_key(elem, sort_data);
+        };
+        sort_data->current_index = current_index = CommonPrefix(begin, end, current_index, current_key, element_key);
+        It end_of_shorter_ones = std::partition(begin, end, [&](auto && elem)
+        {
+            return ListAccess<ListType>::ends_at(current_key(elem), current_index);
+        });
+        std::ptrdiff_t num_shorter_ones = end_of_shorter_ones - begin;
+        if (sort_data->next_sort && !StdSortIfLessThanThreshold<StdSortThreshold>(begin, end_of_shorter_ones, num_shorter_ones, extract_key))
+        {
+            sort_data->next_sort(begin, end_of_shorter_ones, num_shorter_ones, extract_key, next_sort_data);
+        }
+        std::ptrdiff_t num_elements = end - end_of_shorter_ones;
+        if (!StdSortIfLessThanThreshold<StdSortThreshold>(end_of_shorter_ones, end, num_elements, extract_key))
+        {
+            void (*sort_next_element)(It, It, std::ptrdiff_t, ExtractKey &, void *) = static_cast<void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *)>(&sort_from_recursion);
+            InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, ElementSubKey>::sort(end_of_shorter_ones, end, num_elements, extract_key, sort_next_element, sort_data);
+        }
+    }
+
+    template<typename It, typename ExtractKey>
+    static void sort_from_recursion(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void * next_sort_data)
+    {
+        ListSortData<It, ExtractKey> offset = *static_cast<ListSortData<It, ExtractKey> *>(next_sort_data);
+        ++offset.current_index;
+        --offset.recursion_limit;
+        if (offset.recursion_limit == 0)
+        {
+            int depth_limit = 0;
+            for (; num_elements > 1; num_elements /= 2)
+                depth_limit += 2;
+            multikey_quicksort(begin, end, extract_key, &offset, depth_limit, HasScalarElements());
+        }
+        else
+        {
+            sort(begin, end, extract_key, &offset);
+        }
+    }
+
+    // multikey quicksort only needs to compare one element of each list at a
+    // time, which is cheap if the elements have a single unsigned sub key.
+    // for other elements we let std::sort compare the whole keys
+    using HasScalarElements = std::integral_constant<bool, std::is_integral<typename ElementSubKey::base::sub_key_type>::value && std::is_same<typename ElementSubKey::base::next, SubKey<void>>::value>;
+    static constexpr std::ptrdiff_t MultikeyInsertionSortThreshold = 16;
+
+    template<typename It, typename ExtractKey>
+    static void multikey_quicksort(It begin, It end, ExtractKey & extract_key, ListSortData<It, ExtractKey> *, int, std::false_type)
+    {
+        StdSortFallback(begin, end, extract_key);
+    }
+
+    // sorts lists that are known to be equal up to sort_data->current_index
+    // without comparing that common prefix again
+    template<typename It, typename ExtractKey>
+    static void multikey_quicksort(It begin, It end, ExtractKey & extract_key, ListSortData<It, ExtractKey> * sort_data, int depth_limit, std::true_type)
+    {
+        size_t current_index = sort_data->current_index;
+        void * next_sort_data = sort_data->next_sort_data;
+        auto current_key = [&](auto && elem) -> decltype(auto)
+        {
+            return CurrentSubKey::sub_key(extract_key(elem), next_sort_data);
+        };
+        auto element_key = [&](auto && elem)
+        {
+            return ElementSubKey::base::sub_key(elem, sort_data);
+        };
+        for (;;)
+        {
+            It end_of_shorter_ones = std::partition(begin, end, [&](auto && elem)
+            {
+                return ListAccess<ListType>::ends_at(current_key(elem), current_index);
+            });
+            std::ptrdiff_t num_shorter_ones = end_of_shorter_ones - begin;
+            if (sort_data->next_sort && !StdSortIfLessThanThreshold<StdSortThreshold>(begin, end_of_shorter_ones, num_shorter_ones, extract_key))
+            {
+                sort_data->next_sort(begin, end_of_shorter_ones, num_shorter_ones, extract_key, next_sort_data);
+            }
+            begin = end_of_shorter_ones;
+            std::ptrdiff_t num_elements = end - begin;
+            if (num_elements <= 1)
+                return;
+            else if (depth_limit == 0)
+            {
+                StdSortFallback(begin, end, extract_key);
+                return;
+            }
+            else if (num_elements < MultikeyInsertionSortThreshold)
+            {
+                insertion_sort_from_index(begin, end, current_index, extract_key, sort_data);
+                return;
+            }
+            auto current_element = [&](auto && elem)
+            {
+                return element_key(current_key(elem)[current_index]);
+            };
+            auto first = current_element(*begin);
+            auto middle = current_element(begin[num_elements / 2]);
+            auto last = current_element(end[-1]);
+            auto pivot = std::max(std::min(first, middle), std::min(std::max(first, middle), last));
+            It less_end = begin;
+            It greater_begin = end;
+            for (It it = begin; it != greater_begin;)
+            {
+                auto element = current_element(*it);
+                if (element < pivot)
+                {
+                    std::iter_swap(less_end, it);
+                    ++less_end;
+                    ++it;
+                }
+                else if (pivot < element)
+                {
+                    --greater_begin;
+                    std::iter_swap(it, greater_begin);
+                }
+                else
+                    ++it;
+            }
+            ListSortData<It, ExtractKey> child_data = *sort_data;
+            child_data.current_index = current_index;
+            multikey_quicksort(begin, less_end, extract_key, &child_data, depth_limit - 1, std::true_type());
+            multikey_quicksort(greater_begin, end, extract_key, &child_data, depth_limit - 1, std::true_type());
+            begin = less_end;
+            end = greater_begin;
+            ++current_index;
+            --depth_limit;
+        }
+    }
+
+    template<typename It, typename ExtractKey>
+    static int compare_from_index(It lhs, It rhs, size_t index, ExtractKey & extract_key, ListSortData<It, ExtractKey> * sort_data)
+    {
+        const ListType & l = CurrentSubKey::sub_key(extract_key(*lhs), sort_data->next_sort_data);
+        const ListType & r = CurrentSubKey::sub_key(extract_key(*rhs), sort_data->next_sort_data);
+        for (;; ++index)
+        {
+            bool l_ended = ListAccess<ListType>::ends_at(l, index);
+            bool r_ended = ListAccess<ListType>::ends_at(r, index);
+            if (l_ended || r_ended)
+                return l_ended == r_ended ? 0 : (l_ended ? -1 : 1);
+            auto l_element = ElementSubKey::base::sub_key(l[index], sort_data);
+            auto r_element = ElementSubKey::base::sub_key(r[index], sort_data);
+            if (l_element < r_element)
+                return -1;
+            else if (r_element < l_element)
+                return 1;
+        }
+    }
+
+    template<typename It, typename ExtractKey>
+    static void insertion_sort_from_index(It begin, It end, size_t index, ExtractKey & extract_key, ListSortData<It, ExtractKey> * sort_data)
+    {
+        for (It it = std::next(begin); it != end; ++it)
+        {
+            for (It insert = it; insert != begin && compare_from_index(std::prev(insert), insert, index, extract_key, sort_data) > 0; --insert)
+                std::iter_swap(std::prev(insert), insert);
+        }
+        if (!sort_data->next_sort)
+            return;
+        for (It run_begin = begin; run_begin != end;)
+        {
+            It run_end = std::next(run_begin);
+            while (run_end != end && compare_from_index(run_begin, run_end, index, extract_key, sort_data) == 0)
+                ++run_end;
+            std::ptrdiff_t num_elements = run_end - run_begin;
+            if (!StdSortIfLessThanThreshold<StdSortThreshold>(run_begin, run_end, num_elements, extract_key))
+                sort_data->next_sort(run_begin, run_end, num_elements, extract_key, sort_data->next_sort_data);
+            run_begin = run_end;
+        }
+    }
+
+
+    template<typename It, typename ExtractKey>
+    static void sort(It begin, It end, std::ptrdiff_t, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * next_sort_data)
+    {
+        ListSortData<It, ExtractKey> offset;
+        offset.current_index = 0;
+        offset.recursion_limit = 16;
+        offset.next_sort = next_sort;
+        offset.next_sort_data = next_sort_data;
+        sort(begin, end, extract_key, &offset);
+    }
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, bool>
+{
+    template<typename It, typename ExtractKey>
+    static void sort(It begin, It end, std::ptrdiff_t, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data)
+    {
+        It middle = std::partition(begin, end, [&](auto && a){ return !CurrentSubKey::sub_key(extract_key(a), sort_data); });
+        if (next_sort)
+        {
+            next_sort(begin, middle, middle - begin, extract_key, sort_data);
+            next_sort(middle, end, end - middle, extract_key, sort_data);
+        }
+    }
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint8_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 1>
+{
+};
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint16_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 2>
+{
+};
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint32_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 4>
+{
+};
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint64_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 8>
+{
+};
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, size_t NumBytes>
+struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, PackedKeyBytes<NumBytes>> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes>
+{
+};
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType, typename Enable = void>
+struct FallbackInplaceSorter;
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType>
+struct InplaceSorter : FallbackInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, SubKeyType>
+{
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType>
+struct FallbackInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, SubKeyType, typename std::enable_if<has_subscript_operator<SubKeyType>::value>::type>
+	: ListInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, SubKeyType>
+{
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct SortStarter;
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold>
+struct SortStarter<StdSortThreshold, AmericanFlagSortThreshold, SubKey<void>>
+{
+    template<typename It, typename ExtractKey>
+    static void sort(It, It, std::ptrdiff_t, ExtractKey &, void *)
+    {
+    }
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
+struct SortStarter
+{
+    template<typename It, typename ExtractKey>
+    static void sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void * next_sort_data = nullptr)
+    {
+        if (StdSortIfLessThanThreshold<StdSortThreshold>(begin, end, num_elements, extract_key))
+            return;
+
+        void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *) = static_cast<void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *)>(&SortStarter<StdSortThreshold, AmericanFlagSortThreshold, typename CurrentSubKey::next>::sort);
+        if (next_sort == static_cast<void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *)>(&SortStarter<StdSortThreshold, AmericanFlagSortThreshold, SubKey<void>>::sort))
+            next_sort = nullptr;
+        InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey>::sort(begin, end, num_elements, extract_key, next_sort, next_sort_data);
+    }
+};
+
+template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename It, typename ExtractKey>
+void inplace_radix_sort(It begin, It end, ExtractKey & extract_key)
+{
+    using SubKey = SubKey<decltype(extract_key(*begin))>;
+    SortStarter<StdSortThreshold, AmericanFlagSortThreshold, SubKey>::sort(begin, end, end - begin, extract_key);
+}
+
+template<typename T>
+inline bool radix_keys_equal(const T & l, const T & r, std::true_type)
+{
+    return to_unsigned_or_bool(l) == to_unsigned_or_bool(r);
+}
+template<typename T>
+inline bool radix_keys_equal(const T & l, const T & r, std::false_type)
+{
+    return l == r;
+}
+
+template<typename It, typename ExtractDigit>
+std::vector<size_t> radix_partition(It begin, It end, int num_bits, ExtractDigit & extract_digit)
+{
+    size_t num_buckets = size_t(1) << num_bits;
+    size_t digit_mask = num_buckets - 1;
+    auto digit = [&](auto && elem)
+    {
+        return static_cast<size_t>(extract_digit(elem)) & digit_mask;
+    };
+    std::vector<PartitionInfo> partitions(num_buckets);
+    for (It it = begin; it != end; ++it)
+    {
+        ++partitions[digit(*it)].count;
+    }
+    std::vector<size_t> boundaries(num_buckets + 1);
+    std::vector<std::uint32_t> remaining_partitions;
+    size_t total = 0;
+    for (size_t i = 0; i < num_buckets; ++i)
+    {
+        size_t count = partitions[i].count;
+        boundaries[i] = total;
+        if (count)
+        {
+            partitions[i].offset = total;
+            total += count;
+            remaining_partitions.push_back(static_cast<std::uint32_t>(i));
+        }
+        partitions[i].next_offset = total;
+    }
+    boundaries[num_buckets] = total;
+    swap_into_partitions(begin, partitions.data(), remaining_partitions.data(), static_cast<int>(remaining_partitions.size()), digit);
+    return boundaries;
+}
+
+template<typename It, typename OutIt, typename ExtractDigit>
+std::vector<size_t> radix_partition_copy(It begin, It end, OutIt out_begin, int num_bits, ExtractDigit & extract_digit)
+{
+    size_t num_buckets = size_t(1) << num_bits;
+    size_t digit_mask = num_buckets - 1;
+    auto digit = [&](auto && elem)
+    {
+        return static_cast<size_t>(extract_digit(elem)) & digit_mask;
+    };
+    std::vector<size_t> boundaries(num_buckets + 1);
+    for (It it = begin; it != end; ++it)
+    {
+        ++boundaries[digit(*it) + 1];
+    }
+    for (size_t i = 0; i < num_buckets; ++i)
+    {
+        boundaries[i + 1] += boundaries[i];
+    }
+    std::vector<size_t> offsets(boundaries.begin(), boundaries.end() - 1);
+    for (; begin != end; ++begin)
+    {
+        out_begin[offsets[digit(*begin)]++] = std::move(*begin);
+    }
+    return boundaries;
+}
+
+static constexpr std::ptrdiff_t GroupAggregateHashThreshold = 4096;
+
+template<typename KeyType, typename Group>
+struct GroupAggregateScratch
+{
+    std::vector<Group> groups;
+    std::vector<KeyType> group_keys;
+    std::vector<std::int32_t> slots;
+    std::vector<std::uint32_t> order;
+
+    template<typename OutIt>
+    OutIt write_sorted(OutIt out)
+    {
+        order.resize(groups.size());
+        for (size_t i = 0; i < order.size(); ++i)
+            order[i] = static_cast<std::uint32_t>(i);
+        std::sort(order.begin(), order.end(), [&](std::uint32_t l, std::uint32_t r)
+        {
+            return group_keys[l] < group_keys[r];
+        });
+        for (std::uint32_t index : order)
+        {
+            *out = std::move(groups[index]);
+            ++out;
+        }
+        groups.clear();
+        group_keys.clear();
+        return out;
+    }
+};
+
+// aggregates [begin, end) with a hash table that has room for every element.
+// only used once a bucket is small enough for the table to stay in cache
+template<typename It, typename OutIt, typename GetKey, typename ExtractKey, typename ExtractValue, typename Combine, typename Scratch>
+OutIt group_aggregate_hash(It begin, It end, std::ptrdiff_t num_elements, OutIt out, GetKey & get_key, ExtractKey & extract_key, ExtractValue & extract_value, Combine & combine, Scratch & scratch)
+{
+    size_t num_slots = 2;
+    while (num_slots < static_cast<size_t>(num_elements) * 2)
+        num_slots *= 2;
+    int shift = 64;
+    for (size_t i = num_slots; i > 1; i /= 2)
+        --shift;
+    scratch.slots.assign(num_slots, -1);
+    for (; begin != end; ++begin)
+    {
+        auto key = get_key(*begin);
+        for (size_t slot = static_cast<size_t>(fibonacci_hash(static_cast<std::uint64_t>(key)) >> shift);; slot = (slot + 1) & (num_slots - 1))
+        {
+            std::int32_t index = scratch.slots[slot];
+            if (index < 0)
+            {
+                scratch.slots[slot] = static_cast<std::int32_t>(scratch.groups.size());
+                scratch.groups.emplace_back(extract_key(*begin), extract_value(*begin));
+                scratch.group_keys.push_back(key);
+                break;
+            }
+            else if (scratch.group_keys[index] == key)
+            {
+                scratch.groups[index].second = combine(std::move(scratch.groups[index].second), extract_value(*begin));
+                break;
+            }
+        }
+    }
+    return scratch.write_sorted(out);
+}
+
+// tries to aggregate [begin, end) with a DistinctKeyTable. returns false
+// without writing anything if there are too many distinct keys
+template<typename It, typename OutIt, typename GetKey, typename ExtractKey, typename ExtractValue, typename Combine, typename Scratch>
+bool group_aggregate_few_keys(It begin, It end, std::ptrdiff_t num_elements, OutIt & out, GetKey & get_key, ExtractKey & extract_key, ExtractValue & extract_value, Combine & combine, Scratch & scratch)
+{
+    using KeyType = decltype(get_key(*begin));
+    DistinctKeyTable<KeyType> table;
+    if (!sample_distinct_keys(begin, num_elements, table, get_key))
+        return false;
+    // the table assigns indices in insertion order, so the groups have to
+    // be created in the same order as the keys were seen in the sample
+    std::int8_t group_for_key[DistinctKeyTable<KeyType>::max_distinct];
+    std::fill(group_for_key, group_for_key + DistinctKeyTable<KeyType>::max_distinct, -1);
+    for (; begin != end; ++begin)
+    {
+        auto key = get_key(*begin);
+        int index = table.find_or_insert(key);
+        if (index < 0)
+        {
+            scratch.groups.clear();
+            scratch.group_keys.clear();
+            return false;
+        }
+        std::int8_t & group = group_for_key[index];
+        if (group < 0)
+        {
+            group = static_cast<std::int8_t>(scratch.groups.size());
+            scratch.groups.emplace_back(extract_key(*begin), extract_value(*begin));
+            scratch.group_keys.push_back(key);
+        }
+        else
+            scratch.groups[group].second = combine(std::move(scratch.groups[group].second), extract_value(*begin));
+    }
+    out = scratch.write_sorted(out);
+    return true;
+}
+
+template<typename It, typename OutIt, typename GetKey, typename ExtractKey, typename ExtractValue, typename Combine, typename Scratch>
+OutIt group_aggregate_msd(It begin, It end, int shift, OutIt out, GetKey & get_key, ExtractKey & extract_key, ExtractValue & extract_value, Combine & combine, Scratch & scratch)
+{
+    std::ptrdiff_t num_elements = end - begin;
+    if (num_elements <= GroupAggregateHashThreshold)
+        return group_aggregate_hash(begin, end, num_elements, out, get_key, extract_key, extract_value, combine, scratch);
+    if (group_aggregate_few_keys(begin, end, num_elements, out, get_key, extract_key, extract_value, combine, scratch))
+        return out;
+    PartitionInfo partitions[256];
+    auto current_byte = [&](auto && elem) -> std::uint8_t
+    {
+        return static_cast<std::uint8_t>(get_key(elem) >> shift);
+    };
+    for (It it = begin; it != end; ++it)
+    {
+        ++partitions[current_byte(*it)].count;
+    }
+    std::uint8_t remaining_partitions[256];
+    size_t total = 0;
+    int num_partitions = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        size_t count = partitions[i].count;
+        if (count)
+        {
+            partitions[i].offset = total;
+            total += count;
+            remaining_partitions[num_partitions] = i;
+            ++num_partitions;
+        }
+        partitions[i].next_offset = total;
+    }
+    swap_into_partitions(begin, partitions, remaining_partitions, num_partitions, current_byte);
+    // below the last byte every bucket holds a single key, which
+    // group_aggregate_few_keys always handles, so shift never goes negative
+    size_t start_offset = 0;
+    for (int i = 0; i < 256; ++i)
+    {
+        size_t end_offset = partitions[i].next_offset;
+        if (end_offset != start_offset)
+            out = group_aggregate_msd(begin + start_offset, begin + end_offset, shift - 8, out, get_key, extract_key, extract_value, combine, scratch);
+        start_offset = end_offset;
+    }
+    return out;
+}
+
+template<typename It, typename ExtractKey, typename ExtractValue, typename Combine, typename OutIt>
+OutIt group_aggregate(It begin, It end, ExtractKey & extract_key, ExtractValue & extract_value, Combine & combine, OutIt out, std::true_type)
+{
+    using Key = UnsignedKey<decltype(extract_key(*begin))>;
+    using KeyType = typename Key::type;
+    using Group = std::pair<typename std::decay<decltype(extract_key(*begin))>::type, typename std::decay<decltype(extract_value(*begin))>::type>;
+    auto get_key = [&](auto && elem) -> KeyType
+    {
+        return Key::get(extract_key(elem));
+    };
+    GroupAggregateScratch<KeyType, Group> scratch;
+    return group_aggregate_msd(begin, end, static_cast<int>(sizeof(KeyType) * 8 - 8), out, get_key, extract_key, extract_value, combine, scratch);
+}
+template<typename It, typename ExtractKey, typename ExtractValue, typename Combine, typename OutIt>
+OutIt group_aggregate(It begin, It end, ExtractKey & extract_key, ExtractValue & extract_value, Combine & combine, OutIt out, std::false_type is_unsigned_key)
+{
+    inplace_radix_sort<128, 1024>(begin, end, extract_key);
+    for (It it = begin; it != end;)
+    {
+        auto value = extract_value(*it);
+        It run_end = std::next(it);
+        for (; run_end != end && radix_keys_equal(extract_key(*it), extract_key(*run_end), is_unsigned_key); ++run_end)
+            value = combine(std::move(value), extract_value(*run_end));
+        *out = std::make_pair(extract_key(*it), std::move(value));
+        ++out;
+        it = run_end;
+    }
+    return out;
+}
+
+template<typename It, typename ExtractKey>
+It sort_unique(It begin, It end, ExtractKey & extract_key, std::false_type is_unsigned_key)
+{
+    inplace_radix_sort<128, 1024>(begin, end, extract_key);
+    return std::unique(begin, end, [&](auto && l, auto && r)
+    {
+        return radix_keys_equal(extract_key(l), extract_key(r), is_unsigned_key);
+    });
+}
+template<typename It, typename ExtractKey>
+It sort_unique(It begin, It end, ExtractKey & extract_key, std::true_type)
+{
+    using Key = UnsignedKey<decltype(extract_key(*begin))>;
+    using KeyType = typename Key::type;
+    auto get_key = [&](auto && elem) -> KeyType
+    {
+        return Key::get(extract_key(elem));
+    };
+    DistinctKeyTable<KeyType> table;
+    size_t counts[DistinctKeyTable<KeyType>::max_distinct];
+    if (!count_distinct_keys(begin, end, end - begin, table, counts, get_key))
+        return sort_unique(begin, end, extract_key, std::false_type());
+    // move one element of every key to the front. this stops as soon as
+    // every key was seen, which is usually early in the range
+    bool seen[DistinctKeyTable<KeyType>::max_distinct] = {};
+    It unique_end = begin;
+    It last_unique = begin + table.num_keys;
+    for (It it = begin; unique_end != last_unique; ++it)
+    {
+        int index = table.find(get_key(*it));
+        if (seen[index])
+            continue;
+        seen[index] = true;
+        std::iter_swap(unique_end, it);
+        ++unique_end;
+    }
+    std::sort(begin, unique_end, [&](auto && l, auto && r)
+    {
+        return get_key(l) < get_key(r);
+    });
+    return unique_end;
+}
+
+template<typename It, typename OutIt, typename ExtractKey>
+OutIt sort_count_runs(It begin, It end, OutIt out, ExtractKey & extract_key, std::false_type is_unsigned_key)
+{
+    inplace_radix_sort<128, 1024>(begin, end, extract_key);
+    for (It it = begin; it != end;)
+    {
+        It run_end = std::next(it);
+        while (run_end != end && radix_keys_equal(extract_key(*it), extract_key(*run_end), is_unsigned_key))
+            ++run_end;
+        *out = std::make_pair(extract_key(*it), static_cast<size_t>(run_end - it));
+        ++out;
+        it = run_end;
+    }
+    return out;
+}
+template<typename It, typename OutIt, typename ExtractKey>
+OutIt sort_count_runs(It begin, It end, OutIt out, ExtractKey & extract_key, std::true_type)
+{
+    using Key = UnsignedKey<decltype(extract_key(*begin))>;
+    using KeyType = typename Key::type;
+    using Table = DistinctKeyTable<KeyType>;
+    auto get_key = [&](auto && elem) -> KeyType
+    {
+        return Key::get(extract_key(elem));
+    };
+    Table table;
+    size_t counts[Table::max_distinct];
+    if (!count_distinct_keys(begin, end, end - begin, table, counts, get_key))
+        return sort_count_runs(begin, end, out, extract_key, std::false_type());
+    // the counts are already known, so the runs don't have to be found again
+    PartitionInfo partitions[Table::max_distinct];
+    swap_into_distinct_keys(begin, table, counts, partitions, get_key);
+    size_t start_offset = 0;
+    for (int i = 0; i < table.num_keys; ++i)
+    {
+        size_t end_offset = partitions[i].next_offset;
+        *out = std::make_pair(extract_key(begin[start_offset]), end_offset - start_offset);
+        ++out;
+        start_offset = end_offset;
+    }
+    return out;
+}
+
+struct IdentityFunctor
+{
+    template<typename T>
+    decltype(auto) operator()(T && i) const
+    {
+        return std::forward<T>(i);
     }
+};
 
-    template<typename It, typename ExtractKey>
-    static void american_flag_sort(It begin, It end, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data)
+template<typename It, typename OffsetIt, typename TargetIt, typename ExtractSource, typename ExtractTarget>
+void build_csr(It begin, It end, size_t num_vertices, OffsetIt offsets_begin, TargetIt targets_begin, ExtractSource & extract_source, ExtractTarget & extract_target, bool sort_neighbors)
+{
+    using count_type = typename std::iterator_traits<OffsetIt>::value_type;
+    std::fill(offsets_begin, offsets_begin + (num_vertices + 1), count_type());
+    for (It it = begin; it != end; ++it)
+    {
+        ++offsets_begin[static_cast<size_t>(extract_source(*it)) + 1];
+    }
+    for (size_t i = 0; i < num_vertices; ++i)
+    {
+        offsets_begin[i + 1] += offsets_begin[i];
+    }
+    // same trick as counting_sort_impl: use the row starts as write cursors.
+    // afterwards offsets_begin[v] is the start of row v + 1, so shift back
+    for (; begin != end; ++begin)
+    {
+        targets_begin[offsets_begin[static_cast<size_t>(extract_source(*begin))]++] = extract_target(*begin);
+    }
+    for (size_t i = num_vertices; i > 0; --i)
+    {
+        offsets_begin[i] = offsets_begin[i - 1];
+    }
+    offsets_begin[0] = count_type();
+    if (sort_neighbors)
+    {
+        IdentityFunctor identity;
+        for (size_t i = 0; i < num_vertices; ++i)
+        {
+            inplace_radix_sort<128, 1024>(targets_begin + offsets_begin[i], targets_begin + offsets_begin[i + 1], identity);
+        }
+    }
+}
+
+// moves begin[order[i]] to begin[i] by following the cycles of the
+// permutation. resets order to the identity while doing that
+template<typename It, typename Index>
+void apply_permutation(It begin, std::vector<Index> & order)
+{
+    for (size_t start = 0; start < order.size(); ++start)
+    {
+        if (order[start] == start)
+            continue;
+        typename std::iterator_traits<It>::value_type to_place = std::move(begin[start]);
+        size_t current = start;
+        for (size_t source = order[current]; source != start; source = order[current])
+        {
+            begin[current] = std::move(begin[source]);
+            order[current] = static_cast<Index>(current);
+            current = source;
+        }
+        begin[current] = std::move(to_place);
+        order[current] = static_cast<Index>(current);
+    }
+}
+
+struct BurstEntry
+{
+    ByteStringView suffix;
+    size_t index;
+};
+
+// a burst trie: strings go into the bucket for their first byte, and a
+// bucket that gets too big is replaced by a node that distributes the
+// strings by their next byte. the buckets only hold views of the unsorted
+// part of the strings so they stay small and cache friendly
+template<size_t BurstThreshold>
+struct BurstTrie
+{
+    // below this depth buckets don't burst any more. ska_sort skips the
+    // common prefix of big buckets on its own
+    static constexpr size_t MaxBurstDepth = 128;
+
+    struct Node;
+    struct Slot
+    {
+        std::vector<BurstEntry> bucket;
+        Node * child = nullptr;
+    };
+    struct Node
+    {
+        // slot 0 holds the strings that end at this depth, slot i + 1 the
+        // strings that continue with byte i
+        Slot slots[257];
+        size_t depth = 0;
+    };
+
+    BurstTrie()
+    {
+        nodes.emplace_back(new Node());
+    }
+
+    void insert(BurstEntry entry)
+    {
+        for (Node * node = nodes.front().get();;)
+        {
+            size_t slot_index = pop_slot_index(entry.suffix);
+            Slot & slot = node->slots[slot_index];
+            if (slot.child)
+            {
+                node = slot.child;
+                continue;
+            }
+            slot.bucket.push_back(entry);
+            if (slot_index != 0 && slot.bucket.size() > BurstThreshold && node->depth + 1 < MaxBurstDepth)
+                burst(slot, node->depth + 1);
+            return;
+        }
+    }
+
+    template<typename OutIt>
+    OutIt write_sorted_indices(OutIt out)
+    {
+        return write_sorted_indices(*nodes.front(), out);
+    }
+
+private:
+    std::vector<std::unique_ptr<Node>> nodes;
+
+    static size_t pop_slot_index(ByteStringView & suffix)
+    {
+        if (suffix.length == 0)
+            return 0;
+        size_t result = size_t(suffix.bytes[0]) + 1;
+        ++suffix.bytes;
+        --suffix.length;
+        return result;
+    }
+
+    void burst(Slot & slot, size_t depth)
+    {
+        nodes.emplace_back(new Node());
+        Node * child = nodes.back().get();
+        child->depth = depth;
+        for (BurstEntry & entry : slot.bucket)
+        {
+            child->slots[pop_slot_index(entry.suffix)].bucket.push_back(entry);
+        }
+        std::vector<BurstEntry>().swap(slot.bucket);
+        slot.child = child;
+    }
+
+    template<typename OutIt>
+    OutIt write_sorted_indices(Node & node, OutIt out)
+    {
+        auto suffix_key = [](const BurstEntry & entry) -> const ByteStringView &
+        {
+            return entry.suffix;
+        };
+        for (size_t i = 0; i < 257; ++i)
+        {
+            Slot & slot = node.slots[i];
+            if (slot.child)
+            {
+                out = write_sorted_indices(*slot.child, out);
+                continue;
+            }
+            if (i != 0)
+                inplace_radix_sort<128, 1024>(slot.bucket.begin(), slot.bucket.end(), suffix_key);
+            for (const BurstEntry & entry : slot.bucket)
+            {
+                *out = entry.index;
+                ++out;
+            }
+            std::vector<BurstEntry>().swap(slot.bucket);
+        }
+        return out;
+    }
+};
+
+template<size_t BurstThreshold, typename It, typename ExtractKey>
+void burst_sort(It begin, It end, ExtractKey & extract_key)
+{
+    size_t num_elements = end - begin;
+    if (num_elements <= 1)
+        return;
+    BurstTrie<BurstThreshold> trie;
+    for (size_t i = 0; i < num_elements; ++i)
+    {
+        trie.insert(BurstEntry{ to_byte_string_view(extract_key(begin[i])), i });
+    }
+    std::vector<size_t> order(num_elements);
+    trie.write_sorted_indices(order.begin());
+    apply_permutation(begin, order);
+}
+
+// the key for row indices into a string column in arrow layout
+template<typename OffsetType>
+struct StringColumnKey
+{
+    const OffsetType * offsets;
+    const unsigned char * data;
+
+    template<typename Index>
+    ByteStringView operator()(Index row) const
+    {
+        size_t index = static_cast<size_t>(row);
+        return { data + offsets[index], static_cast<size_t>(offsets[index + 1] - offsets[index]) };
+    }
+};
+
+template<typename Index, typename OffsetType>
+void sort_string_column_copy(const OffsetType * offsets, const unsigned char * data, size_t num_rows, OffsetType * out_offsets, unsigned char * out_data)
+{
+    std::vector<Index> permutation(num_rows);
+    for (size_t i = 0; i < num_rows; ++i)
+    {
+        permutation[i] = static_cast<Index>(i);
+    }
+    StringColumnKey<OffsetType> key{ offsets, data };
+    inplace_radix_sort<128, 1024>(permutation.begin(), permutation.end(), key);
+    OffsetType out_offset = 0;
+    for (size_t i = 0; i < num_rows; ++i)
+    {
+        out_offsets[i] = out_offset;
+        ByteStringView row = key(permutation[i]);
+        if (row.length)
+            std::memcpy(out_data + out_offset, row.bytes, row.length);
+        out_offset += static_cast<OffsetType>(row.length);
+    }
+    out_offsets[num_rows] = out_offset;
+}
+
+// sorts by the mapped bytes first. strings that map to the same bytes are
+// real ties and get sorted by their raw bytes
+template<typename It, typename ExtractKey, typename ByteMap>
+void mapped_sort(It begin, It end, ExtractKey & extract_key, const ByteMap & byte_map)
+{
+    auto mapped_key = [&](auto && elem)
+    {
+        ByteStringView view = to_byte_string_view(extract_key(elem));
+        return std::make_pair(MappedByteStringView<ByteMap>{ view, &byte_map }, view);
+    };
+    inplace_radix_sort<128, 1024>(begin, end, mapped_key);
+}
+
+inline size_t common_prefix_from(const ByteStringView & l, const ByteStringView & r, size_t index)
+{
+    for (size_t end = std::min(l.length, r.length); index < end && l.bytes[index] == r.bytes[index];)
+        ++index;
+    return index;
+}
+
+template<typename It, typename LcpIt, typename ToView>
+void lcp_insertion_sort(It begin, It end, size_t depth, LcpIt lcp_out, ToView & to_view)
+{
+    auto less_from_depth = [&](auto && l, auto && r)
+    {
+        ByteStringView l_view = to_view(l);
+        ByteStringView r_view = to_view(r);
+        size_t common = common_prefix_from(l_view, r_view, depth);
+        return common != r_view.length && (common == l_view.length || l_view.bytes[common] < r_view.bytes[common]);
+    };
+    for (It it = std::next(begin); it < end; ++it)
+    {
+        for (It insert = it; insert != begin && less_from_depth(*insert, *std::prev(insert)); --insert)
+            std::iter_swap(std::prev(insert), insert);
+    }
+    for (std::ptrdiff_t i = 1, num_elements = end - begin; i < num_elements; ++i)
+    {
+        lcp_out[i] = common_prefix_from(to_view(begin[i - 1]), to_view(begin[i]), depth);
+    }
+}
+
+static constexpr std::ptrdiff_t LcpInsertionSortThreshold = 16;
+
+// msd radix sort on the bytes of the strings. every partition boundary
+// is a place where two neighbors first differ, so the lcp at that boundary
+// is the current depth and we get the lcp array without extra comparisons.
+// uses an explicit stack because the depth can be as long as the strings
+template<typename It, typename LcpIt, typename ExtractKey>
+void lcp_sort(It begin, It end, LcpIt lcp_out, ExtractKey & extract_key)
+{
+    std::ptrdiff_t num_elements = end - begin;
+    if (num_elements == 0)
+        return;
+    lcp_out[0] = 0;
+    auto to_view = [&](auto && elem)
+    {
+        return to_byte_string_view(extract_key(elem));
+    };
+    auto element_key = [](unsigned char c)
+    {
+        return c;
+    };
+    struct LcpRange
     {
+        std::ptrdiff_t begin;
+        std::ptrdiff_t end;
+        size_t depth;
+    };
+    std::vector<LcpRange> to_sort = { { 0, num_elements, 0 } };
+    while (!to_sort.empty())
+    {
+        LcpRange range = to_sort.back();
+        to_sort.pop_back();
+        It range_begin = begin + range.begin;
+        It range_end = begin + range.end;
+        if (range.end - range.begin < LcpInsertionSortThreshold)
+        {
+            lcp_insertion_sort(range_begin, range_end, range.depth, lcp_out + range.begin, to_view);
+            continue;
+        }
+        size_t depth = CommonPrefix(range_begin, range_end, range.depth, to_view, element_key);
+        It end_of_shorter_ones = std::partition(range_begin, range_end, [&](auto && elem)
+        {
+            return to_view(elem).size() <= depth;
+        });
+        std::ptrdiff_t partitions_begin = range.begin + (end_of_shorter_ones - range_begin);
+        for (std::ptrdiff_t i = range.begin + 1; i < partitions_begin; ++i)
+        {
+            lcp_out[i] = depth;
+        }
         PartitionInfo partitions[256];
-        for (It it = begin; it != end; ++it)
+        for (It it = end_of_shorter_ones; it != range_end; ++it)
         {
-            ++partitions[current_byte(extract_key(*it), sort_data)].count;
+            ++partitions[to_view(*it)[depth]].count;
         }
-        size_t total = 0;
         uint8_t remaining_partitions[256];
+        size_t total = 0;
         int num_partitions = 0;
         for (int i = 0; i < 256; ++i)
         {
             size_t count = partitions[i].count;
-            if (!count)
-                continue;
-            partitions[i].offset = total;
-            total += count;
+            if (count)
+            {
+                partitions[i].offset = total;
+                total += count;
+                remaining_partitions[num_partitions] = i;
+                ++num_partitions;
+            }
             partitions[i].next_offset = total;
-            remaining_partitions[num_partitions] = i;
-            ++num_partitions;
         }
-        if (num_partitions > 1)
+        swap_into_partitions(end_of_shorter_ones, partitions, remaining_partitions, num_partitions, [&](auto && elem)
         {
-            uint8_t * current_block_ptr = remaining_partitions;
-            PartitionInfo * current_block = partitions + *current_block_ptr;
-            uint8_t * last_block = remaining_partitions + num_partitions - 1;
-            It it = begin;
-            It block_end = begin + current_block->next_offset;
-            It last_element = end - 1;
-            for (;;)
-            {
-                PartitionInfo * block = partitions + current_byte(extract_key(*it), sort_data);
-                if (block == current_block)
-                {
-                    ++it;
-                    if (it == last_element)
-                        break;
-                    else if (it == block_end)
-                    {
-                        for (;;)
-                        {
-                            ++current_block_ptr;
-                            if (current_block_ptr == last_block)
-                                goto recurse;
-                            current_block = partitions + *current_block_ptr;
-                            if (current_block->offset != current_block->next_offset)
-                                break;
-                        }
+            return to_view(elem)[depth];
+        });
+        for (int i = 0; i < num_partitions; ++i)
+        {
+            uint8_t partition = remaining_partitions[i];
+            std::ptrdiff_t partition_begin = partitions_begin + (partition == 0 ? 0 : partitions[partition - 1].next_offset);
+            std::ptrdiff_t partition_end = partitions_begin + partitions[partition].next_offset;
+            if (partition_begin != range.begin)
+                lcp_out[partition_begin] = depth;
+            if (partition_end - partition_begin > 1)
+                to_sort.push_back({ partition_begin, partition_end, depth + 1 });
+        }
+    }
+}
 
-                        it = begin + current_block->offset;
-                        block_end = begin + current_block->next_offset;
-                    }
-                }
-                else
+// memory for scratch buffers. the LSD passes scatter their writes to 256
+// places at once, and on a large buffer with 4k pages almost every one of
+// those writes misses the TLB. so big buffers get mapped with 2mb pages if
+// the system has them reserved, or get transparent huge pages otherwise.
+// everything else, and anything that fails, uses malloc
+struct HugePageMemory
+{
+    static constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+    explicit HugePageMemory(size_t num_bytes)
+    {
+#if defined(__linux__) && defined(MAP_HUGETLB) && defined(MAP_POPULATE)
+        if (num_bytes >= huge_page_size)
+        {
+            size_t rounded_bytes = (num_bytes + huge_page_size - 1) / huge_page_size * huge_page_size;
+            void * mapped = mmap(nullptr, rounded_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+            if (mapped == MAP_FAILED)
+            {
+                mapped = mmap(nullptr, rounded_bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mapped != MAP_FAILED)
                 {
-                    size_t offset = block->offset++;
-                    std::iter_swap(it, begin + offset);
+#ifdef MADV_HUGEPAGE
+                    madvise(mapped, rounded_bytes, MADV_HUGEPAGE);
+#endif
+                    // fault the pages in now, after the madvise, so that
+                    // the kernel can hand out huge pages
+                    for (size_t offset = 0; offset < rounded_bytes; offset += 4096)
+                        static_cast<volatile unsigned char *>(mapped)[offset] = 0;
                 }
             }
+            if (mapped != MAP_FAILED)
+            {
+                data = mapped;
+                mapped_bytes = rounded_bytes;
+                return;
+            }
         }
-        recurse:
-        if (Offset + 1 != NumBytes || next_sort)
+#endif
+        data = std::malloc(num_bytes ? num_bytes : 1);
+        if (!data)
+            throw std::bad_alloc();
+    }
+    ~HugePageMemory()
+    {
+#ifdef __linux__
+        if (mapped_bytes)
+        {
+            munmap(data, mapped_bytes);
+            return;
+        }
+#endif
+        std::free(data);
+    }
+    HugePageMemory(const HugePageMemory &) = delete;
+    HugePageMemory & operator=(const HugePageMemory &) = delete;
+
+    void * data = nullptr;
+    size_t mapped_bytes = 0;
+};
+
+// the LSD sorters assign into the buffer, so types that need construction
+// get a normal std::vector
+template<typename T, bool = std::is_trivially_copyable<T>::value && std::is_trivially_default_constructible<T>::value>
+struct ScratchBuffer
+{
+    explicit ScratchBuffer(size_t size)
+        : memory(size * sizeof(T)), size(size)
+    {
+    }
+
+    T * begin()
+    {
+        return static_cast<T *>(memory.data);
+    }
+    T * end()
+    {
+        return begin() + size;
+    }
+
+private:
+    HugePageMemory memory;
+    size_t size;
+};
+template<typename T>
+struct ScratchBuffer<T, false>
+{
+    explicit ScratchBuffer(size_t size)
+        : buffer(size)
+    {
+    }
+
+    typename std::vector<T>::iterator begin()
+    {
+        return buffer.begin();
+    }
+    typename std::vector<T>::iterator end()
+    {
+        return buffer.end();
+    }
+
+private:
+    std::vector<T> buffer;
+};
+
+// the LSD sorters read and write the whole array once per byte, and for 64
+// bit keys on a big array every one of those passes goes to main memory.
+// the hybrid sorter instead splits the array by the top byte until the
+// buckets fit in the cache, and then sorts every bucket by the remaining
+// bytes with LSD passes while the bucket is still in the cache
+static constexpr std::ptrdiff_t HybridCacheBytes = 512 * 1024;
+// splitting a bucket that is only a bit too big would leave leaves that are
+// too small for LSD passes to be worth it
+static constexpr std::ptrdiff_t HybridMinSplitSize = 256 * 1024;
+static constexpr std::ptrdiff_t HybridStdSortThreshold = 64;
+
+template<typename It, typename OutIt, typename count_type, typename GetWord>
+inline void lsd_scatter_byte(It begin, It end, OutIt out_begin, count_type * counts, int shift, GetWord & get_word)
+{
+    for (It it = begin; it != end; ++it)
+    {
+        std::uint8_t byte = get_word(*it) >> shift;
+        out_begin[counts[byte]++] = std::move(*it);
+    }
+}
+
+// LSD sort by the lowest num_bytes bytes of the word. skips the bytes that
+// are the same for all elements, which after the top level split is often
+// most of them. returns true if the result ended up in the buffer
+template<typename It, typename OutIt, typename GetWord>
+bool lsd_sort_low_bytes(It begin, It end, OutIt buffer_begin, GetWord & get_word, int num_bytes)
+{
+    std::ptrdiff_t num_elements = end - begin;
+    uint32_t counts[8][256] = {};
+    for (It it = begin; it != end; ++it)
+    {
+        std::uint64_t word = get_word(*it);
+        for (int i = 0; i < num_bytes; ++i)
+            ++counts[i][(word >> (8 * i)) & 0xff];
+    }
+    std::uint64_t first_word = get_word(*begin);
+    bool in_buffer = false;
+    for (int i = 0; i < num_bytes; ++i)
+    {
+        if (counts[i][(first_word >> (8 * i)) & 0xff] == static_cast<uint32_t>(num_elements))
+            continue;
+        uint32_t total = 0;
+        for (uint32_t & count : counts[i])
+        {
+            uint32_t old_count = count;
+            count = total;
+            total += old_count;
+        }
+        if (in_buffer)
+            lsd_scatter_byte(buffer_begin, buffer_begin + num_elements, begin, counts[i], 8 * i, get_word);
+        else
+            lsd_scatter_byte(begin, end, buffer_begin, counts[i], 8 * i, get_word);
+        in_buffer = !in_buffer;
+    }
+    return in_buffer;
+}
+
+template<typename T, typename Enable = void>
+struct HybridKey
+{
+    static constexpr bool value = false;
+};
+// 64 bit keys, including pairs and tuples that pack into 64 bits. the
+// leaves only have to look at the bytes below the ones that the top levels
+// split on
+template<typename T>
+struct HybridKey<T, typename std::enable_if<UnsignedKey<T>::value && sizeof(typename UnsignedKey<T>::type) == 8>::type>
+{
+    static constexpr bool value = true;
+
+    template<typename U>
+    static std::uint64_t get(U && value)
+    {
+        return UnsignedKey<T>::get(value);
+    }
+
+    template<typename It, typename OutIt, typename ExtractKey>
+    static bool sort_leaf(It begin, It end, OutIt buffer_begin, ExtractKey & extract_key, int num_bytes)
+    {
+        auto get_word = [&](auto && o)
+        {
+            return get(extract_key(o));
+        };
+        if (end - begin < HybridStdSortThreshold)
+        {
+            std::sort(begin, end, [&](auto && l, auto && r){ return get_word(l) < get_word(r); });
+            return false;
+        }
+        return lsd_sort_low_bytes(begin, end, buffer_begin, get_word, num_bytes);
+    }
+};
+// pairs that are too big to pack get split by the top bytes of the first
+// member, and then the buckets get the normal pair sorter
+template<typename T, typename First>
+struct HybridPairKey
+{
+    static constexpr bool value = true;
+
+    template<typename U>
+    static std::uint64_t get(U && value)
+    {
+        return UnsignedKey<First>::get(value.first);
+    }
+
+    template<typename It, typename OutIt, typename ExtractKey>
+    static bool sort_leaf(It begin, It end, OutIt buffer_begin, ExtractKey & extract_key, int)
+    {
+        if (end - begin < HybridStdSortThreshold)
         {
-            size_t start_offset = 0;
-            It partition_begin = begin;
-            for (uint8_t * it = remaining_partitions, * end = remaining_partitions + num_partitions; it != end; ++it)
-            {
-                size_t end_offset = partitions[*it].next_offset;
-                It partition_end = begin + end_offset;
-                std::ptrdiff_t num_elements = end_offset - start_offset;
-                if (!StdSortIfLessThanThreshold<StdSortThreshold>(partition_begin, partition_end, num_elements, extract_key))
-                {
-                    UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, Offset + 1>::sort(partition_begin, partition_end, num_elements, extract_key, next_sort, sort_data);
-                }
-                start_offset = end_offset;
-                partition_begin = partition_end;
-            }
+            StdSortFallback(begin, end, extract_key);
+            return false;
         }
+        return RadixSorter<T>::sort(begin, end, buffer_begin, extract_key);
     }
+};
+template<typename K, typename V>
+struct HybridKey<std::pair<K, V>, typename std::enable_if<!UnsignedKey<std::pair<K, V>>::value && PackedMemberBytes<K>::value == 8>::type>
+    : HybridPairKey<std::pair<K, V>, K>
+{
+};
+template<typename K, typename V>
+struct HybridKey<const std::pair<K, V> &, typename std::enable_if<!UnsignedKey<std::pair<K, V>>::value && PackedMemberBytes<K>::value == 8>::type>
+    : HybridPairKey<const std::pair<K, V> &, K>
+{
+};
 
-    template<typename It, typename ExtractKey>
-    static void ska_byte_sort(It begin, It end, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data)
+// sorts [begin, end) by the bytes up to and including byte_index of the
+// top word. the result goes to the buffer if result_in_buffer is true,
+// otherwise it stays in [begin, end)
+template<typename Key, typename It, typename OutIt, typename ExtractKey>
+void hybrid_radix_sort(It begin, It end, OutIt buffer_begin, ExtractKey & extract_key, int byte_index, bool result_in_buffer)
+{
+    using value_type = typename std::iterator_traits<It>::value_type;
+    std::ptrdiff_t num_elements = end - begin;
+    for (;;)
     {
-        PartitionInfo partitions[256];
+        if (byte_index < 0 || num_elements < HybridMinSplitSize || num_elements * static_cast<std::ptrdiff_t>(sizeof(value_type)) <= HybridCacheBytes)
+        {
+            bool in_buffer = Key::sort_leaf(begin, end, buffer_begin, extract_key, byte_index + 1);
+            if (in_buffer && !result_in_buffer)
+                std::move(buffer_begin, buffer_begin + num_elements, begin);
+            else if (!in_buffer && result_in_buffer)
+                std::move(begin, end, buffer_begin);
+            return;
+        }
+        int shift = 8 * byte_index;
+        size_t counts[256] = {};
         for (It it = begin; it != end; ++it)
+            ++counts[(Key::get(extract_key(*it)) >> shift) & 0xff];
+        std::uint8_t first_byte = Key::get(extract_key(*begin)) >> shift;
+        if (counts[first_byte] == static_cast<size_t>(num_elements))
         {
-            ++partitions[current_byte(extract_key(*it), sort_data)].count;
+            --byte_index;
+            continue;
         }
-        uint8_t remaining_partitions[256];
-        size_t total = 0;
-        int num_partitions = 0;
+        size_t offsets[257];
+        offsets[0] = 0;
         for (int i = 0; i < 256; ++i)
+            offsets[i + 1] = offsets[i] + counts[i];
+        std::copy(offsets, offsets + 256, counts);
+        for (It it = begin; it != end; ++it)
         {
-            size_t count = partitions[i].count;
-            if (count)
-            {
-                partitions[i].offset = total;
-                total += count;
-                remaining_partitions[num_partitions] = i;
-                ++num_partitions;
-            }
-            partitions[i].next_offset = total;
+            std::uint8_t byte = Key::get(extract_key(*it)) >> shift;
+            buffer_begin[counts[byte]++] = std::move(*it);
         }
-        for (uint8_t * last_remaining = remaining_partitions + num_partitions, * end_partition = remaining_partitions + 1; last_remaining > end_partition;)
+        for (int i = 0; i < 256; ++i)
         {
-            last_remaining = custom_std_partition(remaining_partitions, last_remaining, [&](uint8_t partition)
-            {
-                size_t & begin_offset = partitions[partition].offset;
-                size_t & end_offset = partitions[partition].next_offset;
-                if (begin_offset == end_offset)
-                    return false;
-
-                unroll_loop_four_times(begin + begin_offset, end_offset - begin_offset, [partitions = partitions, begin, &extract_key, sort_data](It it)
-                {
-                    uint8_t this_partition = current_byte(extract_key(*it), sort_data);
-                    size_t offset = partitions[this_partition].offset++;
-                    std::iter_swap(it, begin + offset);
-                });
-                return begin_offset != end_offset;
-            });
+            std::ptrdiff_t bucket_begin = offsets[i];
+            std::ptrdiff_t bucket_end = offsets[i + 1];
+            if (bucket_end - bucket_begin == 1 && !result_in_buffer)
+                begin[bucket_begin] = std::move(buffer_begin[bucket_begin]);
+            else if (bucket_end - bucket_begin > 1)
+                hybrid_radix_sort<Key>(buffer_begin + bucket_begin, buffer_begin + bucket_end, begin + bucket_begin, extract_key, byte_index - 1, !result_in_buffer);
         }
-        if (Offset + 1 != NumBytes || next_sort)
+        return;
+    }
+}
+
+template<typename It, typename OutIt, typename ExtractKey>
+bool radix_sort_copy(It begin, It end, OutIt buffer_begin, ExtractKey & extract_key, std::true_type)
+{
+    using Key = HybridKey<typename std::result_of<ExtractKey(decltype(*begin))>::type>;
+    hybrid_radix_sort<Key>(begin, end, buffer_begin, extract_key, 7, false);
+    return false;
+}
+template<typename It, typename OutIt, typename ExtractKey>
+bool radix_sort_copy(It begin, It end, OutIt buffer_begin, ExtractKey & extract_key, std::false_type)
+{
+    return RadixSorter<typename std::result_of<ExtractKey(decltype(*begin))>::type>::sort(begin, end, buffer_begin, extract_key);
+}
+
+// ska_sort_into never writes to the input, so its first pass copies the
+// elements out of the input instead of moving them. the later passes move
+// elements between the output and a scratch buffer, and the first pass
+// picks its destination so that the last pass lands in the output
+template<typename It, typename OutIt, typename count_type, typename GetWord>
+inline void lsd_copy_byte(It begin, It end, OutIt out_begin, count_type * counts, int shift, GetWord & get_word)
+{
+    for (It it = begin; it != end; ++it)
+    {
+        const auto & elem = *it;
+        std::uint8_t byte = get_word(elem) >> shift;
+        out_begin[counts[byte]++] = elem;
+    }
+}
+
+template<typename It, typename OutIt, typename ExtractKey>
+void sort_into(It begin, It end, OutIt out_begin, ExtractKey & extract_key, std::true_type)
+{
+    using Key = HybridKey<typename std::result_of<ExtractKey(decltype(*begin))>::type>;
+    std::ptrdiff_t num_elements = end - begin;
+    ScratchBuffer<typename std::iterator_traits<It>::value_type> buffer(num_elements);
+    auto get_word = [&](auto && o)
+    {
+        return Key::get(extract_key(o));
+    };
+    size_t counts[256] = {};
+    for (It it = begin; it != end; ++it)
+        ++counts[get_word(*it) >> 56];
+    size_t offsets[257];
+    offsets[0] = 0;
+    for (int i = 0; i < 256; ++i)
+        offsets[i + 1] = offsets[i] + counts[i];
+    std::copy(offsets, offsets + 256, counts);
+    lsd_copy_byte(begin, end, buffer.begin(), counts, 56, get_word);
+    for (int i = 0; i < 256; ++i)
+    {
+        std::ptrdiff_t bucket_begin = offsets[i];
+        std::ptrdiff_t bucket_end = offsets[i + 1];
+        if (bucket_end - bucket_begin == 1)
+            out_begin[bucket_begin] = std::move(buffer.begin()[bucket_begin]);
+        else if (bucket_end - bucket_begin > 1)
+            hybrid_radix_sort<Key>(buffer.begin() + bucket_begin, buffer.begin() + bucket_end, out_begin + bucket_begin, extract_key, 6, true);
+    }
+}
+// counts every byte of a word, unrolled at compile time
+template<int Byte, int NumBytes>
+struct CountAllBytes
+{
+    template<typename Word, typename count_type>
+    static void count(Word word, count_type (*counts)[256])
+    {
+        ++counts[Byte][static_cast<std::uint8_t>(word >> (8 * Byte))];
+        CountAllBytes<Byte + 1, NumBytes>::count(word, counts);
+    }
+};
+template<int NumBytes>
+struct CountAllBytes<NumBytes, NumBytes>
+{
+    template<typename Word, typename count_type>
+    static void count(Word, count_type (*)[256])
+    {
+    }
+};
+
+template<typename count_type, typename It, typename OutIt, typename ExtractKey>
+void lsd_sort_into_impl(It begin, It end, OutIt out_begin, ExtractKey & extract_key)
+{
+    using Unsigned = UnsignedKey<typename std::result_of<ExtractKey(decltype(*begin))>::type>;
+    static constexpr int num_bytes = sizeof(typename Unsigned::type);
+    std::ptrdiff_t num_elements = end - begin;
+    auto get_word = [&](auto && o)
+    {
+        return Unsigned::get(extract_key(o));
+    };
+    count_type counts[num_bytes][256] = {};
+    for (It it = begin; it != end; ++it)
+        CountAllBytes<0, num_bytes>::count(get_word(*it), counts);
+    auto first_word = get_word(*begin);
+    int passes[num_bytes];
+    int num_passes = 0;
+    for (int i = 0; i < num_bytes; ++i)
+    {
+        if (counts[i][static_cast<std::uint8_t>(first_word >> (8 * i))] == static_cast<count_type>(num_elements))
+            continue;
+        count_type total = 0;
+        for (count_type & count : counts[i])
         {
-            for (uint8_t * it = remaining_partitions + num_partitions; it != remaining_partitions; --it)
-            {
-                uint8_t partition = it[-1];
-                size_t start_offset = (partition == 0 ? 0 : partitions[partition - 1].next_offset);
-                size_t end_offset = partitions[partition].next_offset;
-                It partition_begin = begin + start_offset;
-                It partition_end = begin + end_offset;
-                std::ptrdiff_t num_elements = end_offset - start_offset;
-                if (!StdSortIfLessThanThreshold<StdSortThreshold>(partition_begin, partition_end, num_elements, extract_key))
-                {
-                    UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, Offset + 1>::sort(partition_begin, partition_end, num_elements, extract_key, next_sort, sort_data);
-                }
-            }
+            count_type old_count = count;
+            count = total;
+            total += old_count;
         }
+        passes[num_passes++] = i;
+    }
+    if (!num_passes)
+    {
+        std::copy(begin, end, out_begin);
+        return;
+    }
+    ScratchBuffer<typename std::iterator_traits<It>::value_type> buffer(num_passes > 1 ? num_elements : 0);
+    bool in_out = num_passes % 2 == 1;
+    if (in_out)
+        lsd_copy_byte(begin, end, out_begin, counts[passes[0]], 8 * passes[0], get_word);
+    else
+        lsd_copy_byte(begin, end, buffer.begin(), counts[passes[0]], 8 * passes[0], get_word);
+    for (int i = 1; i < num_passes; ++i)
+    {
+        int byte = passes[i];
+        if (in_out)
+            lsd_scatter_byte(out_begin, out_begin + num_elements, buffer.begin(), counts[byte], 8 * byte, get_word);
+        else
+            lsd_scatter_byte(buffer.begin(), buffer.end(), out_begin, counts[byte], 8 * byte, get_word);
+        in_out = !in_out;
     }
+}
+template<typename It, typename OutIt, typename ExtractKey>
+void lsd_sort_into(It begin, It end, OutIt out_begin, ExtractKey & extract_key, std::true_type)
+{
+    if (end - begin < (1ll << 32))
+        lsd_sort_into_impl<uint32_t>(begin, end, out_begin, extract_key);
+    else
+        lsd_sort_into_impl<size_t>(begin, end, out_begin, extract_key);
+}
+// keys that don't fit in an integer get copied and then sorted in place
+template<typename It, typename OutIt, typename ExtractKey>
+void lsd_sort_into(It begin, It end, OutIt out_begin, ExtractKey & extract_key, std::false_type)
+{
+    OutIt out_end = std::copy(begin, end, out_begin);
+    inplace_radix_sort<128, 1024>(out_begin, out_end, extract_key);
+}
+template<typename It, typename OutIt, typename ExtractKey>
+void sort_into(It begin, It end, OutIt out_begin, ExtractKey & extract_key, std::false_type)
+{
+    using key_type = typename std::result_of<ExtractKey(decltype(*begin))>::type;
+    lsd_sort_into(begin, end, out_begin, extract_key, std::integral_constant<bool, UnsignedKey<key_type>::value>());
+}
+
+template<typename Key, typename Index>
+struct MaterializedKey
+{
+    Key key;
+    Index index;
 };
 
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, size_t NumBytes>
-struct UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, NumBytes, NumBytes>
+// calls extract_key once per element and sorts compact (key, index) pairs
+// instead of the elements. the elements only get moved once at the end
+template<typename Index, typename It, typename ExtractKey>
+void materialized_sort(It begin, It end, ExtractKey & extract_key)
 {
-    template<typename It, typename ExtractKey>
-    inline static void sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * next_sort_data)
+    using Unsigned = UnsignedKey<decltype(extract_key(*begin))>;
+    size_t num_elements = end - begin;
+    std::vector<MaterializedKey<typename Unsigned::type, Index>> keys(num_elements);
+    // a loop that does nothing but the key transform, so that for
+    // contiguous floats and doubles it can get vectorized
+    for (size_t i = 0; i < num_elements; ++i)
     {
-        next_sort(begin, end, num_elements, extract_key, next_sort_data);
+        keys[i].key = Unsigned::get(extract_key(begin[i]));
+    }
+    for (size_t i = 0; i < num_elements; ++i)
+    {
+        keys[i].index = static_cast<Index>(i);
+    }
+    auto materialized_key = [](const MaterializedKey<typename Unsigned::type, Index> & key)
+    {
+        return key.key;
+    };
+    inplace_radix_sort<128, 1024>(keys.begin(), keys.end(), materialized_key);
+    std::vector<Index> order(num_elements);
+    for (size_t i = 0; i < num_elements; ++i)
+    {
+        order[i] = keys[i].index;
     }
+    std::vector<MaterializedKey<typename Unsigned::type, Index>>().swap(keys);
+    apply_permutation(begin, order);
+}
+template<typename It, typename ExtractKey>
+void materialized_sort(It begin, It end, ExtractKey & extract_key, std::true_type)
+{
+    if (static_cast<size_t>(end - begin) <= 0xffffffffu)
+        materialized_sort<std::uint32_t>(begin, end, extract_key);
+    else
+        materialized_sort<size_t>(begin, end, extract_key);
+}
+template<typename It, typename ExtractKey>
+void materialized_sort(It begin, It end, ExtractKey & extract_key, std::false_type)
+{
+    inplace_radix_sort<128, 1024>(begin, end, extract_key);
+}
+
+// segments smaller than this don't get a radix sort of their own. instead
+// runs of them that add up to about SegmentBatchSize elements get sorted
+// together
+static constexpr std::ptrdiff_t SmallSegmentSize = 128;
+static constexpr std::ptrdiff_t SegmentBatchSize = 4096;
+// the batched sort does a fixed number of passes per element, so it only
+// beats std::sort per segment once the segments have a few elements each
+static constexpr size_t SegmentBatchMinAverageSize = 8;
+
+template<typename It, typename OffsetIt, typename ExtractKey>
+void sort_segments_separately(It begin, OffsetIt offsets, size_t num_segments, ExtractKey & extract_key)
+{
+    for (size_t segment = 0; segment < num_segments; ++segment)
+    {
+        if (offsets[segment + 1] - offsets[segment] > 1)
+            StdSortFallback(begin + offsets[segment], begin + offsets[segment + 1], extract_key);
+    }
+}
+
+// if the key fits in 32 bits, a run of small segments gets sorted as one
+// array with (segment, key) as the key, with LSD passes into a buffer. the
+// segment is the last pass and doesn't need a histogram because the
+// offsets already say where every segment starts. that way tiny segments
+// get a few passes over the whole run instead of one std::sort each
+template<typename T>
+struct SegmentBatchScratch
+{
+    std::vector<T> buffer;
+    std::vector<std::uint32_t> segments;
+    std::vector<std::uint32_t> segments_buffer;
+    std::vector<size_t> segment_offsets;
 };
 
-template<typename It, typename ExtractKey, typename ElementKey>
-size_t CommonPrefix(It begin, It end, size_t start_index, ExtractKey && extract_key, ElementKey && element_key)
+template<typename It, typename OutIt, typename GetByte>
+inline void scatter_with_segments(It from, size_t num_elements, OutIt to, const std::uint32_t * segments, std::uint32_t * to_segments, size_t * offsets, GetByte && get_byte)
 {
-    const auto & largest_match_list = extract_key(*begin);
-    size_t largest_match = largest_match_list.size();
-    if (largest_match == start_index)
-        return start_index;
-    for (++begin; begin != end; ++begin)
+    for (size_t i = 0; i < num_elements; ++i)
+    {
+        size_t offset = offsets[get_byte(from[i], segments[i])]++;
+        to[offset] = std::move(from[i]);
+        to_segments[offset] = segments[i];
+    }
+}
+
+template<typename It, typename OffsetIt, typename ExtractKey, typename T>
+void sort_segment_batch(It begin, OffsetIt offsets, size_t num_segments, ExtractKey & extract_key, SegmentBatchScratch<T> & scratch, std::true_type)
+{
+    using Unsigned = UnsignedKey<decltype(extract_key(*begin))>;
+    static constexpr int num_bytes = sizeof(typename Unsigned::type);
+    size_t batch_begin = offsets[0];
+    size_t batch_size = offsets[num_segments] - batch_begin;
+    if (batch_size < num_segments * SegmentBatchMinAverageSize)
+        return sort_segments_separately(begin, offsets, num_segments, extract_key);
+    It batch = begin + batch_begin;
+    scratch.buffer.resize(batch_size);
+    scratch.segments.resize(batch_size);
+    scratch.segments_buffer.resize(batch_size);
+    size_t counts[num_bytes][256] = {};
+    for (size_t segment = 0, i = 0; segment < num_segments; ++segment)
     {
-        const auto & current_list = extract_key(*begin);
-        size_t current_size = current_list.size();
-        if (current_size < largest_match)
+        for (size_t segment_end = offsets[segment + 1] - batch_begin; i < segment_end; ++i)
         {
-            largest_match = current_size;
-            if (largest_match == start_index)
-                return start_index;
+            scratch.segments[i] = static_cast<std::uint32_t>(segment);
+            auto key = Unsigned::get(extract_key(batch[i]));
+            for (int byte = 0; byte < num_bytes; ++byte)
+                ++counts[byte][(key >> (8 * byte)) & 0xff];
         }
-        if (element_key(largest_match_list[start_index]) != element_key(current_list[start_index]))
-            return start_index;
-        for (size_t i = start_index + 1; i < largest_match; ++i)
+    }
+    std::uint32_t * segments = scratch.segments.data();
+    std::uint32_t * segments_buffer = scratch.segments_buffer.data();
+    bool in_buffer = false;
+    for (int byte = 0; byte < num_bytes; ++byte)
+    {
+        if (std::count(counts[byte], counts[byte] + 256, 0) == 255)
+            continue;
+        size_t total = 0;
+        for (size_t & count : counts[byte])
         {
-            if (element_key(largest_match_list[i]) != element_key(current_list[i]))
-            {
-                largest_match = i;
-                break;
-            }
+            size_t old_count = count;
+            count = total;
+            total += old_count;
         }
+        auto get_byte = [&](auto && elem, std::uint32_t)
+        {
+            return static_cast<std::uint8_t>(Unsigned::get(extract_key(elem)) >> (8 * byte));
+        };
+        if (in_buffer)
+            scatter_with_segments(scratch.buffer.begin(), batch_size, batch, segments_buffer, segments, counts[byte], get_byte);
+        else
+            scatter_with_segments(batch, batch_size, scratch.buffer.begin(), segments, segments_buffer, counts[byte], get_byte);
+        in_buffer = !in_buffer;
     }
-    return largest_match;
+    scratch.segment_offsets.resize(num_segments);
+    for (size_t segment = 0; segment < num_segments; ++segment)
+        scratch.segment_offsets[segment] = offsets[segment] - batch_begin;
+    auto get_segment = [](auto &&, std::uint32_t segment)
+    {
+        return segment;
+    };
+    if (in_buffer)
+        scatter_with_segments(scratch.buffer.begin(), batch_size, batch, segments_buffer, segments, scratch.segment_offsets.data(), get_segment);
+    else
+    {
+        scatter_with_segments(batch, batch_size, scratch.buffer.begin(), segments, segments_buffer, scratch.segment_offsets.data(), get_segment);
+        std::move(scratch.buffer.begin(), scratch.buffer.end(), batch);
+    }
+}
+template<typename It, typename OffsetIt, typename ExtractKey, typename T>
+void sort_segment_batch(It begin, OffsetIt offsets, size_t num_segments, ExtractKey & extract_key, SegmentBatchScratch<T> &, std::false_type)
+{
+    sort_segments_separately(begin, offsets, num_segments, extract_key);
 }
 
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename ListType>
-struct ListInplaceSorter
+template<typename It, typename OffsetIt, typename ExtractKey>
+void segmented_sort(It begin, OffsetIt offsets_begin, OffsetIt offsets_end, ExtractKey & extract_key)
 {
-    using ElementSubKey = ListElementSubKey<CurrentSubKey, ListType>;
-    template<typename It, typename ExtractKey>
-    static void sort(It begin, It end, ExtractKey & extract_key, ListSortData<It, ExtractKey> * sort_data)
+    using value_type = typename std::iterator_traits<It>::value_type;
+    using can_batch = std::integral_constant<bool, PackedMemberBytes<decltype(extract_key(*begin))>::value <= 4
+                                                   && std::is_default_constructible<value_type>::value>;
+    size_t num_segments = offsets_end - offsets_begin - 1;
+    SegmentBatchScratch<value_type> scratch;
+    size_t batch_first = 0;
+    auto sort_batch = [&](size_t batch_end)
     {
-        size_t current_index = sort_data->current_index;
-        void * next_sort_data = sort_data->next_sort_data;
-        auto current_key = [&](auto && elem) -> decltype(auto)
-        {
-            return CurrentSubKey::sub_key(extract_key(elem), next_sort_data);
-        };
-        auto element_key = [&](auto && elem) -> decltype(auto)
+        size_t batch_segments = batch_end - batch_first;
+        if (batch_segments > 1)
+            sort_segment_batch(begin, offsets_begin + batch_first, batch_segments, extract_key, scratch, can_batch());
+        else if (batch_segments == 1)
+            sort_segments_separately(begin, offsets_begin + batch_first, 1, extract_key);
+        batch_first = batch_end;
+    };
+    for (size_t segment = 0; segment < num_segments; ++segment)
+    {
+        std::ptrdiff_t segment_begin = offsets_begin[segment];
+        std::ptrdiff_t segment_end = offsets_begin[segment + 1];
+        if (segment_end - segment_begin < SmallSegmentSize)
         {
-            return ElementSubKey::base::sub_key(elem, sort_data);
-        };
-        sort_data->current_index = current_index = CommonPrefix(begin, end, current_index, current_key, element_key);
-        It end_of_shorter_ones = std::partition(begin, end, [&](auto && elem)
+            if (segment_end - static_cast<std::ptrdiff_t>(offsets_begin[batch_first]) > SegmentBatchSize)
+                sort_batch(segment);
+            continue;
+        }
+        sort_batch(segment);
+        batch_first = segment + 1;
+        inplace_radix_sort<128, 1024>(begin + segment_begin, begin + segment_end, extract_key);
+    }
+    sort_batch(num_segments);
+}
+
+// linked lists get sorted by relinking the nodes into one bucket list per
+// byte value, starting at the most significant byte, and then chaining the
+// buckets back together. the payloads never move. every pass over a list
+// is a walk through nodes all over memory, so instead of LSD passes over
+// the whole list this recurses into the buckets until they are small and
+// then merge sorts them, which also only relinks nodes. both are stable.
+// bytes that are the same in every key get skipped
+static constexpr size_t ListMergeSortThreshold = 1024;
+
+template<typename Node, typename GetNext, typename Less>
+Node * merge_linked_lists(Node * l, Node * r, GetNext & next, Less & less)
+{
+    Node * head = nullptr;
+    Node ** tail = &head;
+    while (l && r)
+    {
+        if (less(*r, *l))
         {
-            return current_key(elem).size() <= current_index;
-        });
-        std::ptrdiff_t num_shorter_ones = end_of_shorter_ones - begin;
-        if (sort_data->next_sort && !StdSortIfLessThanThreshold<StdSortThreshold>(begin, end_of_shorter_ones, num_shorter_ones, extract_key))
+            *tail = r;
+            tail = &next(*r);
+            r = *tail;
+        }
+        else
         {
-            sort_data->next_sort(begin, end_of_shorter_ones, num_shorter_ones, extract_key, next_sort_data);
+            *tail = l;
+            tail = &next(*l);
+            l = *tail;
         }
-        std::ptrdiff_t num_elements = end - end_of_shorter_ones;
-        if (!StdSortIfLessThanThreshold<StdSortThreshold>(end_of_shorter_ones, end, num_elements, extract_key))
+    }
+    *tail = l ? l : r;
+    return head;
+}
+
+template<typename Node, typename GetNext, typename ExtractKey>
+Node * linked_list_merge_sort(Node * head, GetNext & next, ExtractKey & extract_key)
+{
+    auto less = [&](Node & l, Node & r){ return sort_key_less(extract_key(l), extract_key(r)); };
+    // bins[i] is null or a sorted run of 2^i nodes. earlier nodes are in
+    // higher bins, which keeps the merges stable
+    Node * bins[64] = {};
+    while (head)
+    {
+        Node * carry = head;
+        head = next(*head);
+        next(*carry) = nullptr;
+        int bin = 0;
+        for (; bins[bin]; ++bin)
         {
-            void (*sort_next_element)(It, It, std::ptrdiff_t, ExtractKey &, void *) = static_cast<void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *)>(&sort_from_recursion);
-            InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, ElementSubKey>::sort(end_of_shorter_ones, end, num_elements, extract_key, sort_next_element, sort_data);
+            carry = merge_linked_lists(bins[bin], carry, next, less);
+            bins[bin] = nullptr;
         }
+        bins[bin] = carry;
+    }
+    for (Node * bin : bins)
+    {
+        if (bin)
+            head = merge_linked_lists(bin, head, next, less);
+    }
+    return head;
+}
+
+// sorts the list that starts at *head and returns the next pointer of the
+// last node, so that the caller can keep appending without walking the list
+template<typename Unsigned, typename Node, typename GetNext, typename ExtractKey>
+Node ** linked_list_radix_sort(Node ** head, size_t num_nodes, typename Unsigned::type different, int byte, GetNext & next, ExtractKey & extract_key)
+{
+    while (byte >= 0 && !static_cast<std::uint8_t>(different >> (8 * byte)))
+        --byte;
+    if (num_nodes < ListMergeSortThreshold || byte < 0)
+    {
+        *head = linked_list_merge_sort(*head, next, extract_key);
+        Node ** tail = head;
+        while (*tail)
+            tail = &next(**tail);
+        return tail;
+    }
+    Node * bucket_heads[256] = {};
+    Node ** bucket_tails[256];
+    size_t counts[256] = {};
+    for (int i = 0; i < 256; ++i)
+        bucket_tails[i] = &bucket_heads[i];
+    for (Node * node = *head; node;)
+    {
+        Node * following = next(*node);
+        std::uint8_t bucket = static_cast<std::uint8_t>(Unsigned::get(extract_key(*node)) >> (8 * byte));
+        *bucket_tails[bucket] = node;
+        bucket_tails[bucket] = &next(*node);
+        ++counts[bucket];
+        node = following;
+    }
+    Node ** tail = head;
+    for (int i = 0; i < 256; ++i)
+    {
+        if (!counts[i])
+            continue;
+        *bucket_tails[i] = nullptr;
+        *tail = bucket_heads[i];
+        tail = linked_list_radix_sort<Unsigned>(tail, counts[i], different, byte - 1, next, extract_key);
+    }
+    return tail;
+}
+template<typename Node, typename GetNext, typename ExtractKey>
+Node * linked_list_sort(Node * head, GetNext & next, ExtractKey & extract_key, std::true_type)
+{
+    using Unsigned = UnsignedKey<decltype(extract_key(*head))>;
+    typename Unsigned::type first_key = Unsigned::get(extract_key(*head));
+    typename Unsigned::type different = 0;
+    size_t num_nodes = 0;
+    for (Node * node = head; node; node = next(*node))
+    {
+        different |= Unsigned::get(extract_key(*node)) ^ first_key;
+        ++num_nodes;
+    }
+    linked_list_radix_sort<Unsigned>(&head, num_nodes, different, sizeof(different) - 1, next, extract_key);
+    return head;
+}
+template<typename Node, typename GetNext, typename ExtractKey>
+Node * linked_list_sort(Node * head, GetNext & next, ExtractKey & extract_key, std::false_type)
+{
+    return linked_list_merge_sort(head, next, extract_key);
+}
+
+// std::list and std::forward_list don't give access to their nodes, so the
+// buckets are lists themselves and the nodes get moved with splice
+template<typename Unsigned, typename It, typename ExtractKey>
+typename Unsigned::type differing_key_bits(It begin, It end, ExtractKey & extract_key, size_t & num_elements)
+{
+    typename Unsigned::type first_key = Unsigned::get(extract_key(*begin));
+    typename Unsigned::type different = 0;
+    for (; begin != end; ++begin)
+    {
+        different |= Unsigned::get(extract_key(*begin)) ^ first_key;
+        ++num_elements;
     }
+    return different;
+}
 
-    template<typename It, typename ExtractKey>
-    static void sort_from_recursion(It begin, It end, std::ptrdiff_t, ExtractKey & extract_key, void * next_sort_data)
+template<typename List, typename ExtractKey>
+void list_sort(List & list, ExtractKey & extract_key, std::false_type)
+{
+    using T = typename List::value_type;
+    list.sort([&](const T & l, const T & r){ return sort_key_less(extract_key(l), extract_key(r)); });
+}
+template<typename Unsigned, typename T, typename A, typename ExtractKey>
+void list_radix_sort(std::list<T, A> & list, size_t num_elements, typename Unsigned::type different, int byte, ExtractKey & extract_key)
+{
+    while (byte >= 0 && !static_cast<std::uint8_t>(different >> (8 * byte)))
+        --byte;
+    if (num_elements < ListMergeSortThreshold || byte < 0)
+        return list_sort(list, extract_key, std::false_type());
+    std::vector<std::list<T, A>> buckets(256, std::list<T, A>(list.get_allocator()));
+    size_t counts[256] = {};
+    while (!list.empty())
     {
-        ListSortData<It, ExtractKey> offset = *static_cast<ListSortData<It, ExtractKey> *>(next_sort_data);
-        ++offset.current_index;
-        --offset.recursion_limit;
-        if (offset.recursion_limit == 0)
-        {
-            StdSortFallback(begin, end, extract_key);
-        }
-        else
-        {
-            sort(begin, end, extract_key, &offset);
-        }
+        std::uint8_t bucket = static_cast<std::uint8_t>(Unsigned::get(extract_key(list.front())) >> (8 * byte));
+        buckets[bucket].splice(buckets[bucket].end(), list, list.begin());
+        ++counts[bucket];
     }
+    for (int i = 0; i < 256; ++i)
+    {
+        if (!counts[i])
+            continue;
+        list_radix_sort<Unsigned>(buckets[i], counts[i], different, byte - 1, extract_key);
+        list.splice(list.end(), buckets[i]);
+    }
+}
+template<typename Unsigned, typename T, typename A, typename ExtractKey>
+void list_radix_sort(std::forward_list<T, A> & list, size_t num_elements, typename Unsigned::type different, int byte, ExtractKey & extract_key)
+{
+    while (byte >= 0 && !static_cast<std::uint8_t>(different >> (8 * byte)))
+        --byte;
+    if (num_elements < ListMergeSortThreshold || byte < 0)
+        return list_sort(list, extract_key, std::false_type());
+    std::vector<std::forward_list<T, A>> buckets(256, std::forward_list<T, A>(list.get_allocator()));
+    typename std::forward_list<T, A>::iterator bucket_tails[256];
+    size_t counts[256] = {};
+    for (int i = 0; i < 256; ++i)
+        bucket_tails[i] = buckets[i].before_begin();
+    while (!list.empty())
+    {
+        std::uint8_t bucket = static_cast<std::uint8_t>(Unsigned::get(extract_key(list.front())) >> (8 * byte));
+        buckets[bucket].splice_after(bucket_tails[bucket], list, list.before_begin());
+        ++bucket_tails[bucket];
+        ++counts[bucket];
+    }
+    // going from the back, every bucket goes to the front of the list. that
+    // way each splice only walks the bucket that it moves
+    for (int i = 255; i >= 0; --i)
+    {
+        if (!counts[i])
+            continue;
+        list_radix_sort<Unsigned>(buckets[i], counts[i], different, byte - 1, extract_key);
+        list.splice_after(list.before_begin(), buckets[i]);
+    }
+}
 
+template<typename List, typename ExtractKey>
+void list_sort(List & list, ExtractKey & extract_key, std::true_type)
+{
+    using Unsigned = UnsignedKey<decltype(extract_key(list.front()))>;
+    size_t num_elements = 0;
+    auto different = differing_key_bits<Unsigned>(list.begin(), list.end(), extract_key, num_elements);
+    list_radix_sort<Unsigned>(list, num_elements, different, sizeof(different) - 1, extract_key);
+}
 
-    template<typename It, typename ExtractKey>
-    static void sort(It begin, It end, std::ptrdiff_t, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * next_sort_data)
+// appends a byte string to out so that comparing two encodings with memcmp
+// gives the same order as comparing the keys. the encodings of keys of the
+// same type are prefix free, so no encoding is a prefix of another one
+template<typename T, typename Enable = void>
+struct KeyEncoder
+{
+    static void encode(const T & value, std::vector<unsigned char> & out)
     {
-        ListSortData<It, ExtractKey> offset;
-        offset.current_index = 0;
-        offset.recursion_limit = 16;
-        offset.next_sort = next_sort;
-        offset.next_sort_data = next_sort_data;
-        sort(begin, end, extract_key, &offset);
+        using RadixKey = typename std::decay<decltype(to_radix_sort_key(value))>::type;
+        KeyEncoder<RadixKey>::encode(to_radix_sort_key(value), out);
     }
 };
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, bool>
+template<typename T>
+struct KeyEncoder<T, typename std::enable_if<UnsignedKey<T>::value>::type>
 {
-    template<typename It, typename ExtractKey>
-    static void sort(It begin, It end, std::ptrdiff_t, ExtractKey & extract_key, void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *), void * sort_data)
+    static void encode(const T & value, std::vector<unsigned char> & out)
     {
-        It middle = std::partition(begin, end, [&](auto && a){ return !CurrentSubKey::sub_key(extract_key(a), sort_data); });
-        if (next_sort)
+        auto key = UnsignedKey<T>::get(value);
+        for (int shift = 8 * (static_cast<int>(sizeof(key)) - 1); shift >= 0; shift -= 8)
         {
-            next_sort(begin, middle, middle - begin, extract_key, sort_data);
-            next_sort(middle, end, end - middle, extract_key, sort_data);
+            out.push_back(static_cast<unsigned char>(key >> shift));
         }
     }
 };
 
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint8_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 1>
+// zero bytes get escaped as 00 ff and the string ends with 00 00, so that
+// a string sorts before all strings that it is a prefix of
+inline void encode_string_bytes(ByteStringView str, std::vector<unsigned char> & out)
 {
-};
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint16_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 2>
+    for (size_t i = 0; i < str.length; ++i)
+    {
+        out.push_back(str.bytes[i]);
+        if (str.bytes[i] == 0)
+            out.push_back(0xff);
+    }
+    out.push_back(0);
+    out.push_back(0);
+}
+template<typename Traits, typename Allocator>
+struct KeyEncoder<std::basic_string<char, Traits, Allocator>>
 {
+    static void encode(const std::basic_string<char, Traits, Allocator> & value, std::vector<unsigned char> & out)
+    {
+        encode_string_bytes(to_byte_string_view(value), out);
+    }
 };
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint32_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 4>
+template<>
+struct KeyEncoder<ska_c_string>
 {
+    static void encode(const ska_c_string & value, std::vector<unsigned char> & out)
+    {
+        encode_string_bytes(to_byte_string_view(value), out);
+    }
 };
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, uint64_t> : UnsignedInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, 8>
+#if __cplusplus >= 201703L
+template<typename Traits>
+struct KeyEncoder<std::basic_string_view<char, Traits>>
 {
+    static void encode(std::basic_string_view<char, Traits> value, std::vector<unsigned char> & out)
+    {
+        encode_string_bytes(to_byte_string_view(value), out);
+    }
 };
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType, typename Enable = void>
-struct FallbackInplaceSorter;
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType>
-struct InplaceSorter : FallbackInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, SubKeyType>
+// empty optionals sort first
+template<typename T>
+struct KeyEncoder<std::optional<T>>
 {
+    static void encode(const std::optional<T> & value, std::vector<unsigned char> & out)
+    {
+        out.push_back(value ? 1 : 0);
+        if (value)
+            KeyEncoder<T>::encode(*value, out);
+    }
 };
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey, typename SubKeyType>
-struct FallbackInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, SubKeyType, typename std::enable_if<has_subscript_operator<SubKeyType>::value>::type>
-	: ListInplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey, SubKeyType>
+#endif
+template<typename F, typename S>
+struct KeyEncoder<std::pair<F, S>, typename std::enable_if<!UnsignedKey<std::pair<F, S>>::value>::type>
 {
+    static void encode(const std::pair<F, S> & value, std::vector<unsigned char> & out)
+    {
+        KeyEncoder<F>::encode(value.first, out);
+        KeyEncoder<S>::encode(value.second, out);
+    }
 };
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct SortStarter;
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold>
-struct SortStarter<StdSortThreshold, AmericanFlagSortThreshold, SubKey<void>>
+template<size_t Index, size_t Size>
+struct TupleKeyEncoder
 {
-    template<typename It, typename ExtractKey>
-    static void sort(It, It, std::ptrdiff_t, ExtractKey &, void *)
+    template<typename Tuple>
+    static void encode(const Tuple & value, std::vector<unsigned char> & out)
     {
+        KeyEncoder<typename std::tuple_element<Index, Tuple>::type>::encode(std::get<Index>(value), out);
+        TupleKeyEncoder<Index + 1, Size>::encode(value, out);
     }
 };
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename CurrentSubKey>
-struct SortStarter
+template<size_t Size>
+struct TupleKeyEncoder<Size, Size>
 {
-    template<typename It, typename ExtractKey>
-    static void sort(It begin, It end, std::ptrdiff_t num_elements, ExtractKey & extract_key, void * next_sort_data = nullptr)
+    template<typename Tuple>
+    static void encode(const Tuple &, std::vector<unsigned char> &)
     {
-        if (StdSortIfLessThanThreshold<StdSortThreshold>(begin, end, num_elements, extract_key))
-            return;
-
-        void (*next_sort)(It, It, std::ptrdiff_t, ExtractKey &, void *) = static_cast<void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *)>(&SortStarter<StdSortThreshold, AmericanFlagSortThreshold, typename CurrentSubKey::next>::sort);
-        if (next_sort == static_cast<void (*)(It, It, std::ptrdiff_t, ExtractKey &, void *)>(&SortStarter<StdSortThreshold, AmericanFlagSortThreshold, SubKey<void>>::sort))
-            next_sort = nullptr;
-        InplaceSorter<StdSortThreshold, AmericanFlagSortThreshold, CurrentSubKey>::sort(begin, end, num_elements, extract_key, next_sort, next_sort_data);
     }
 };
-
-template<std::ptrdiff_t StdSortThreshold, std::ptrdiff_t AmericanFlagSortThreshold, typename It, typename ExtractKey>
-void inplace_radix_sort(It begin, It end, ExtractKey & extract_key)
-{
-    using SubKey = SubKey<decltype(extract_key(*begin))>;
-    SortStarter<StdSortThreshold, AmericanFlagSortThreshold, SubKey>::sort(begin, end, end - begin, extract_key);
-}
-
-struct IdentityFunctor
+template<typename... Args>
+struct KeyEncoder<std::tuple<Args...>, typename std::enable_if<!UnsignedKey<std::tuple<Args...>>::value>::type>
 {
-    template<typename T>
-    decltype(auto) operator()(T && i) const
+    static void encode(const std::tuple<Args...> & value, std::vector<unsigned char> & out)
     {
-        return std::forward<T>(i);
+        TupleKeyEncoder<0, sizeof...(Args)>::encode(value, out);
     }
 };
 }
@@ -1429,17 +4599,385 @@ static void ska_sort(It begin, It end)
 template<typename It, typename OutIt, typename ExtractKey>
 bool ska_sort_copy(It begin, It end, OutIt buffer_begin, ExtractKey && key)
 {
+    using key_type = typename std::result_of<ExtractKey(decltype(*begin))>::type;
+    using use_hybrid = std::integral_constant<bool, detail::HybridKey<key_type>::value>;
     std::ptrdiff_t num_elements = end - begin;
-    if (num_elements < 128 || detail::radix_sort_pass_count<typename std::result_of<ExtractKey(decltype(*begin))>::type> >= 8)
+    if (num_elements < 128 || (detail::radix_sort_pass_count<key_type> >= 8 && !use_hybrid::value))
     {
         ska_sort(begin, end, key);
         return false;
     }
     else
-        return detail::RadixSorter<typename std::result_of<ExtractKey(decltype(*begin))>::type>::sort(begin, end, buffer_begin, key);
+        return detail::radix_sort_copy(begin, end, buffer_begin, key, use_hybrid());
 }
 template<typename It, typename OutIt>
 bool ska_sort_copy(It begin, It end, OutIt buffer_begin)
 {
     return ska_sort_copy(begin, end, buffer_begin, detail::IdentityFunctor());
 }
+
+// same as ska_sort_copy, but allocates its own scratch buffer, using huge
+// pages for large inputs where available. the result always ends up in
+// [begin, end)
+template<typename It, typename ExtractKey>
+void ska_sort_copy_managed(It begin, It end, ExtractKey && key)
+{
+    using key_type = typename std::result_of<ExtractKey(decltype(*begin))>::type;
+    using use_hybrid = std::integral_constant<bool, detail::HybridKey<key_type>::value>;
+    std::ptrdiff_t num_elements = end - begin;
+    if (num_elements < 128 || (detail::radix_sort_pass_count<key_type> >= 8 && !use_hybrid::value))
+    {
+        ska_sort(begin, end, key);
+        return;
+    }
+    detail::ScratchBuffer<typename std::iterator_traits<It>::value_type> buffer(num_elements);
+    if (detail::radix_sort_copy(begin, end, buffer.begin(), key, use_hybrid()))
+        std::move(buffer.begin(), buffer.end(), begin);
+}
+template<typename It>
+void ska_sort_copy_managed(It begin, It end)
+{
+    ska_sort_copy_managed(begin, end, detail::IdentityFunctor());
+}
+
+// sorts the range and removes consecutive elements with equal keys, like
+// calling std::unique after ska_sort. returns the new end of the range.
+// if there are only a few distinct keys this never sorts the full range
+template<typename It, typename ExtractKey>
+It ska_sort_unique(It begin, It end, ExtractKey && key)
+{
+    if (begin == end)
+        return end;
+    using is_unsigned_key = std::integral_constant<bool, detail::UnsignedKey<decltype(key(*begin))>::value>;
+    return detail::sort_unique(begin, end, key, is_unsigned_key());
+}
+template<typename It>
+It ska_sort_unique(It begin, It end)
+{
+    return ska_sort_unique(begin, end, detail::IdentityFunctor());
+}
+
+// sorts the range and writes a std::pair of (key, number of elements with
+// that key) to out for every distinct key, in sorted order
+template<typename It, typename OutIt, typename ExtractKey>
+OutIt ska_sort_count_runs(It begin, It end, OutIt out, ExtractKey && key)
+{
+    if (begin == end)
+        return out;
+    using is_unsigned_key = std::integral_constant<bool, detail::UnsignedKey<decltype(key(*begin))>::value>;
+    return detail::sort_count_runs(begin, end, out, key, is_unsigned_key());
+}
+template<typename It, typename OutIt>
+OutIt ska_sort_count_runs(It begin, It end, OutIt out)
+{
+    return ska_sort_count_runs(begin, end, out, detail::IdentityFunctor());
+}
+
+// partitions the range in place into 2^num_bits buckets by the lowest
+// num_bits bits of extract_digit(element). extract_digit can pick any bit
+// range out of the key, or return a hash of the key. returns 2^num_bits + 1
+// offsets: bucket i is [begin + result[i], begin + result[i + 1])
+template<typename It, typename ExtractDigit>
+std::vector<size_t> ska_partition(It begin, It end, int num_bits, ExtractDigit && extract_digit)
+{
+    return detail::radix_partition(begin, end, num_bits, extract_digit);
+}
+
+// same as ska_partition but moves the elements into the buffer starting at
+// out_begin. this is one read pass plus one write pass over the data
+template<typename It, typename OutIt, typename ExtractDigit>
+std::vector<size_t> ska_partition_copy(It begin, It end, OutIt out_begin, int num_bits, ExtractDigit && extract_digit)
+{
+    return detail::radix_partition_copy(begin, end, out_begin, num_bits, extract_digit);
+}
+
+// computes one aggregate per distinct key, like sorting the range and then
+// folding the values of every run of equal keys with combine. for every key
+// it writes a std::pair of (key, combine(...combine(v0, v1)..., vn)) to out,
+// in sorted order. the range gets reordered, but elements with the same key
+// are never sorted against each other
+template<typename It, typename ExtractKey, typename ExtractValue, typename Combine, typename OutIt>
+OutIt ska_group_aggregate(It begin, It end, ExtractKey && extract_key, ExtractValue && extract_value, Combine && combine, OutIt out)
+{
+    if (begin == end)
+        return out;
+    using is_unsigned_key = std::integral_constant<bool, detail::UnsignedKey<decltype(extract_key(*begin))>::value>;
+    return detail::group_aggregate(begin, end, extract_key, extract_value, combine, out, is_unsigned_key());
+}
+
+// builds a compressed sparse row adjacency structure from an edge list using
+// one counting pass and one scatter pass. offsets_begin has to point at
+// num_vertices + 1 counters, and row v of the result is
+// [targets_begin + offsets[v], targets_begin + offsets[v + 1]). rows keep
+// the order of the edge list unless sort_neighbors is set
+template<typename It, typename OffsetIt, typename TargetIt, typename ExtractSource, typename ExtractTarget>
+void ska_build_csr(It begin, It end, size_t num_vertices, OffsetIt offsets_begin, TargetIt targets_begin, ExtractSource && extract_source, ExtractTarget && extract_target, bool sort_neighbors = false)
+{
+    detail::build_csr(begin, end, num_vertices, offsets_begin, targets_begin, extract_source, extract_target, sort_neighbors);
+}
+template<typename It, typename OffsetIt, typename TargetIt>
+void ska_build_csr(It begin, It end, size_t num_vertices, OffsetIt offsets_begin, TargetIt targets_begin, bool sort_neighbors = false)
+{
+    ska_build_csr(begin, end, num_vertices, offsets_begin, targets_begin, [](auto && edge){ return edge.first; }, [](auto && edge){ return edge.second; }, sort_neighbors);
+}
+
+// sorts strings with a burst trie: the strings get distributed into small
+// buckets by their leading bytes and only the buckets get sorted, so for
+// very large sets of strings each string gets touched fewer times than in
+// ska_sort. the keys can be std::string, std::string_view or const char *
+template<typename It, typename ExtractKey>
+void ska_sort_burst(It begin, It end, ExtractKey && key)
+{
+    detail::burst_sort<8192>(begin, end, key);
+}
+template<typename It>
+void ska_sort_burst(It begin, It end)
+{
+    ska_sort_burst(begin, end, detail::IdentityFunctor());
+}
+
+// sorts strings like ska_sort and also writes the length of the longest
+// common prefix of every string with the string before it to lcp_out, which
+// needs room for one entry per string. lcp_out[0] is always 0. the keys can
+// be std::string, std::string_view or const char *
+template<typename It, typename LcpIt, typename ExtractKey>
+void ska_sort_lcp(It begin, It end, LcpIt lcp_out, ExtractKey && key)
+{
+    detail::lcp_sort(begin, end, lcp_out, key);
+}
+template<typename It, typename LcpIt>
+void ska_sort_lcp(It begin, It end, LcpIt lcp_out)
+{
+    ska_sort_lcp(begin, end, lcp_out, detail::IdentityFunctor());
+}
+
+// sorts the rows of a string column in arrow layout, where row i is the
+// bytes from data + offsets[i] to data + offsets[i + 1]. writes the num_rows
+// row indices in sorted order to permutation and doesn't touch the column
+template<typename OffsetType, typename IndexIt>
+void ska_sort_string_column(const OffsetType * offsets, const void * data, size_t num_rows, IndexIt permutation)
+{
+    using index_type = typename std::iterator_traits<IndexIt>::value_type;
+    for (size_t i = 0; i < num_rows; ++i)
+    {
+        permutation[i] = static_cast<index_type>(i);
+    }
+    detail::StringColumnKey<OffsetType> key{ offsets, static_cast<const unsigned char *>(data) };
+    ska_sort(permutation, permutation + num_rows, key);
+}
+
+// same as ska_sort_string_column but writes the sorted column to out_offsets
+// (num_rows + 1 entries, starting at 0) and out_data (as many bytes as the
+// input rows use)
+template<typename OffsetType>
+void ska_sort_string_column_copy(const OffsetType * offsets, const void * data, size_t num_rows, OffsetType * out_offsets, void * out_data)
+{
+    const unsigned char * in_bytes = static_cast<const unsigned char *>(data);
+    unsigned char * out_bytes = static_cast<unsigned char *>(out_data);
+    if (num_rows <= 0xffffffffu)
+        detail::sort_string_column_copy<std::uint32_t>(offsets, in_bytes, num_rows, out_offsets, out_bytes);
+    else
+        detail::sort_string_column_copy<size_t>(offsets, in_bytes, num_rows, out_offsets, out_bytes);
+}
+
+// sorts strings by their bytes after passing every byte through byte_map,
+// which is either a functor from unsigned char to unsigned char or a table
+// of 256 bytes. that is enough for case folding and simple collations.
+// strings that map to the same bytes are sorted by their raw bytes
+template<typename It, typename ExtractKey, typename ByteMap>
+void ska_sort_mapped(It begin, It end, ExtractKey && key, const ByteMap & byte_map)
+{
+    detail::mapped_sort(begin, end, key, byte_map);
+}
+template<typename It, typename ExtractKey>
+void ska_sort_mapped(It begin, It end, ExtractKey && key, const unsigned char (&byte_table)[256])
+{
+    detail::mapped_sort(begin, end, key, detail::ByteTable{ byte_table });
+}
+
+// sorts strings ignoring ASCII case. works on UTF-8 text, where everything
+// outside of ASCII keeps its byte order
+template<typename It, typename ExtractKey>
+void ska_sort_case_insensitive(It begin, It end, ExtractKey && key)
+{
+    detail::mapped_sort(begin, end, key, detail::AsciiCaseFold());
+}
+template<typename It>
+void ska_sort_case_insensitive(It begin, It end)
+{
+    ska_sort_case_insensitive(begin, end, detail::IdentityFunctor());
+}
+
+// memcmp comparable encodings of a range of keys, stored back to back in
+// one buffer. the key of row i is the key_size(i) bytes at key_data(i).
+// two encoded keys compare like memcmp on the shorter length, and if that
+// is equal the shorter one comes first
+struct ska_encoded_keys
+{
+    std::vector<unsigned char> arena;
+    std::vector<size_t> offsets;
+
+    size_t size() const
+    {
+        return offsets.empty() ? 0 : offsets.size() - 1;
+    }
+    const unsigned char * key_data(size_t row) const
+    {
+        return arena.data() + offsets[row];
+    }
+    size_t key_size(size_t row) const
+    {
+        return offsets[row + 1] - offsets[row];
+    }
+};
+
+// appends the encoding of one key to out. use this to encode search keys
+// for range lookups in keys encoded by ska_encode_keys
+template<typename T>
+void ska_encode_key(const T & value, std::vector<unsigned char> & out)
+{
+    detail::KeyEncoder<T>::encode(value, out);
+}
+
+// encodes the key of every element once. integers, floats and bools, any
+// type with a to_radix_sort_key function, std::string, ska_c_string, and
+// pairs and tuples of those are supported, as well as std::string_view and
+// std::optional in C++17
+template<typename It, typename ExtractKey>
+ska_encoded_keys ska_encode_keys(It begin, It end, ExtractKey && key)
+{
+    ska_encoded_keys result;
+    result.offsets.reserve(static_cast<size_t>(end - begin) + 1);
+    for (; begin != end; ++begin)
+    {
+        result.offsets.push_back(result.arena.size());
+        detail::KeyEncoder<typename std::decay<decltype(key(*begin))>::type>::encode(key(*begin), result.arena);
+    }
+    result.offsets.push_back(result.arena.size());
+    return result;
+}
+template<typename It>
+ska_encoded_keys ska_encode_keys(It begin, It end)
+{
+    return ska_encode_keys(begin, end, detail::IdentityFunctor());
+}
+
+// writes the row ids of the encoded keys in sorted order to permutation.
+// rows with equal keys stay in their original order
+template<typename IndexIt>
+void ska_sort_encoded(const ska_encoded_keys & keys, IndexIt permutation)
+{
+    using index_type = typename std::iterator_traits<IndexIt>::value_type;
+    size_t num_rows = keys.size();
+    for (size_t i = 0; i < num_rows; ++i)
+    {
+        permutation[i] = static_cast<index_type>(i);
+    }
+    detail::StringColumnKey<size_t> column{ keys.offsets.data(), keys.arena.data() };
+    ska_sort(permutation, permutation + num_rows, [&](index_type row)
+    {
+        return std::make_pair(column(row), row);
+    });
+}
+
+// like ska_sort, but calls key only once per element. the keys get stored
+// in a side array next to the element indices, all radix passes read only
+// that array, and then every element gets moved into place once. use this
+// when key is expensive or the elements are large. keys that don't have a
+// single unsigned representation, like strings, get sorted with ska_sort
+template<typename It, typename ExtractKey>
+void ska_sort_materialized(It begin, It end, ExtractKey && key)
+{
+    if (begin == end)
+        return;
+    using is_unsigned_key = std::integral_constant<bool, detail::UnsignedKey<decltype(key(*begin))>::value>;
+    detail::materialized_sort(begin, end, key, is_unsigned_key());
+}
+template<typename It>
+void ska_sort_materialized(It begin, It end)
+{
+    ska_sort_materialized(begin, end, detail::IdentityFunctor());
+}
+
+// sorts many independent segments that lie back to back, like the rows of
+// a CSR matrix. offsets holds one more entry than there are segments, and
+// segment i is [begin + offsets[i], begin + offsets[i + 1]). big segments
+// get sorted like ska_sort would sort them. small segments get batched
+// together, and if the key fits in 32 bits each batch gets radix sorted as
+// one array with (segment, key) as the key
+template<typename It, typename OffsetIt, typename ExtractKey>
+void ska_segmented_sort(It begin, OffsetIt offsets_begin, OffsetIt offsets_end, ExtractKey && key)
+{
+    if (offsets_end - offsets_begin < 2)
+        return;
+    detail::segmented_sort(begin, offsets_begin, offsets_end, key);
+}
+template<typename It, typename OffsetIt>
+void ska_segmented_sort(It begin, OffsetIt offsets_begin, OffsetIt offsets_end)
+{
+    ska_segmented_sort(begin, offsets_begin, offsets_end, detail::IdentityFunctor());
+}
+
+// sorts a std::list or std::forward_list by relinking its nodes. the
+// elements are never copied or moved, and the sort is stable
+template<typename T, typename A, typename ExtractKey>
+void ska_sort_list(std::list<T, A> & list, ExtractKey && key)
+{
+    if (list.empty())
+        return;
+    detail::list_sort(list, key, std::integral_constant<bool, detail::UnsignedKey<decltype(key(list.front()))>::value>());
+}
+template<typename T, typename A>
+void ska_sort_list(std::list<T, A> & list)
+{
+    ska_sort_list(list, detail::IdentityFunctor());
+}
+template<typename T, typename A, typename ExtractKey>
+void ska_sort_list(std::forward_list<T, A> & list, ExtractKey && key)
+{
+    if (list.empty())
+        return;
+    detail::list_sort(list, key, std::integral_constant<bool, detail::UnsignedKey<decltype(key(list.front()))>::value>());
+}
+template<typename T, typename A>
+void ska_sort_list(std::forward_list<T, A> & list)
+{
+    ska_sort_list(list, detail::IdentityFunctor());
+}
+
+// sorts a singly linked list of nodes that the caller owns. next(node) has
+// to return a reference to the pointer to the following node, and the last
+// node points to nullptr. returns the new first node. stable, and only the
+// next pointers get written
+template<typename Node, typename GetNext, typename ExtractKey>
+Node * ska_sort_linked_list(Node * head, GetNext && next, ExtractKey && key)
+{
+    if (!head)
+        return head;
+    return detail::linked_list_sort(head, next, key, std::integral_constant<bool, detail::UnsignedKey<decltype(key(*head))>::value>());
+}
+
+// sorts a copy of [begin, end) into the range starting at out_begin, and
+// leaves the input alone, so the input can be read only memory. the first
+// pass reads from the input and the result always ends up in the output.
+// like the buffer of ska_sort_copy, the output has to hold end - begin
+// elements already
+template<typename It, typename OutIt, typename ExtractKey>
+void ska_sort_into(It begin, It end, OutIt out_begin, ExtractKey && key)
+{
+    using key_type = typename std::result_of<ExtractKey(decltype(*begin))>::type;
+    using use_hybrid = std::integral_constant<bool, detail::HybridKey<key_type>::value>;
+    std::ptrdiff_t num_elements = end - begin;
+    if (num_elements < 128)
+    {
+        OutIt out_end = std::copy(begin, end, out_begin);
+        ska_sort(out_begin, out_end, key);
+    }
+    else
+        detail::sort_into(begin, end, out_begin, key, use_hybrid());
+}
+template<typename It, typename OutIt>
+void ska_sort_into(It begin, It end, OutIt out_begin)
+{
+    ska_sort_into(begin, end, out_begin, detail::IdentityFunctor());
+}
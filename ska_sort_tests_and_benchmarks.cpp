@@ -59,6 +59,10 @@ static void american_flag_sort(It begin, It end)
 #ifdef ENABLE_GTEST
 
 #include <vector>
+#include <random>
+#include <deque>
+#include <list>
+#include <forward_list>
 #include <gtest/gtest.h>
 
 TEST(counting_sort, simple)
@@ -870,6 +874,1182 @@ TEST(inplace_radix_sort, no_copy)
     ASSERT_TRUE(std::is_sorted(to_sort.begin(), to_sort.end(), sort_by_last_name));
 }
 
+TEST(ska_sort, low_cardinality)
+{
+    std::mt19937_64 randomness(77342348);
+    const uint64_t values[] = { 5, 1000000000000, 7, std::numeric_limits<uint64_t>::max(), 1000000000001 };
+    std::uniform_int_distribution<int> value_picker(0, 4);
+    std::vector<uint64_t> to_sort(10000);
+    for (uint64_t & value : to_sort)
+        value = values[value_picker(randomness)];
+    std::vector<uint64_t> copy = to_sort;
+    ska_sort(to_sort.begin(), to_sort.end());
+    std::sort(copy.begin(), copy.end());
+    ASSERT_EQ(copy, to_sort);
+}
+TEST(inplace_radix_sort, low_cardinality_pair)
+{
+    std::mt19937_64 randomness(77342348);
+    std::uniform_int_distribution<int64_t> first_distribution(-2, 1);
+    std::uniform_int_distribution<int> second_distribution;
+    std::vector<std::pair<int64_t, int>> to_sort(2000);
+    for (std::pair<int64_t, int> & value : to_sort)
+        value = { first_distribution(randomness), second_distribution(randomness) };
+    std::vector<std::pair<int64_t, int>> copy = to_sort;
+    inplace_radix_sort(to_sort.begin(), to_sort.end());
+    std::sort(copy.begin(), copy.end());
+    ASSERT_EQ(copy, to_sort);
+}
+TEST(ska_sort, low_cardinality_sample_misses_values)
+{
+    // the sampled positions all hold the same value, but the range as a
+    // whole has too many distinct values for the low cardinality path
+    std::vector<uint32_t> to_sort(4096);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+        to_sort[i] = i % 64 == 0 ? 12345 : static_cast<uint32_t>(to_sort.size() - i);
+    std::vector<uint32_t> copy = to_sort;
+    ska_sort(to_sort.begin(), to_sort.end());
+    std::sort(copy.begin(), copy.end());
+    ASSERT_EQ(copy, to_sort);
+}
+
+TEST(ska_sort_unique, few_distinct)
+{
+    std::mt19937_64 randomness(77342348);
+    std::uniform_int_distribution<int> distribution(-3, 3);
+    std::vector<int> to_sort(5000);
+    for (int & value : to_sort)
+        value = distribution(randomness) * 1000;
+    std::vector<int> copy = to_sort;
+    auto new_end = ska_sort_unique(to_sort.begin(), to_sort.end());
+    to_sort.erase(new_end, to_sort.end());
+    std::sort(copy.begin(), copy.end());
+    copy.erase(std::unique(copy.begin(), copy.end()), copy.end());
+    ASSERT_EQ(copy, to_sort);
+}
+TEST(ska_sort_unique, many_distinct)
+{
+    std::mt19937_64 randomness(77342348);
+    std::uniform_int_distribution<int> distribution(0, 1000);
+    std::vector<std::pair<int, int>> to_sort(5000);
+    for (std::pair<int, int> & value : to_sort)
+        value = { distribution(randomness), 0 };
+    std::vector<std::pair<int, int>> copy = to_sort;
+    auto new_end = ska_sort_unique(to_sort.begin(), to_sort.end(), [](const std::pair<int, int> & p){ return p.first; });
+    to_sort.erase(new_end, to_sort.end());
+    std::sort(copy.begin(), copy.end());
+    copy.erase(std::unique(copy.begin(), copy.end()), copy.end());
+    ASSERT_EQ(copy, to_sort);
+}
+TEST(ska_sort_unique, string)
+{
+    std::vector<std::string> to_sort = { "foo", "bar", "foo", "", "baz", "bar", "", "foo" };
+    auto new_end = ska_sort_unique(to_sort.begin(), to_sort.end());
+    to_sort.erase(new_end, to_sort.end());
+    std::vector<std::string> expected = { "", "bar", "baz", "foo" };
+    ASSERT_EQ(expected, to_sort);
+}
+TEST(ska_sort_count_runs, few_distinct)
+{
+    std::vector<uint64_t> to_sort;
+    for (uint64_t i = 0; i < 1000; ++i)
+        to_sort.push_back((i % 3) * 1000000000000 + (i % 2));
+    std::vector<std::pair<uint64_t, size_t>> runs;
+    ska_sort_count_runs(to_sort.begin(), to_sort.end(), std::back_inserter(runs));
+    ASSERT_TRUE(std::is_sorted(to_sort.begin(), to_sort.end()));
+    std::vector<std::pair<uint64_t, size_t>> expected =
+    {
+        { 0, 167 }, { 1, 167 },
+        { 1000000000000, 166 }, { 1000000000001, 167 },
+        { 2000000000000, 167 }, { 2000000000001, 166 },
+    };
+    ASSERT_EQ(expected, runs);
+}
+TEST(ska_sort_count_runs, string)
+{
+    std::vector<std::string> to_sort = { "foo", "bar", "foo", "", "baz", "bar", "", "foo" };
+    std::vector<std::pair<std::string, size_t>> runs;
+    ska_sort_count_runs(to_sort.begin(), to_sort.end(), std::back_inserter(runs));
+    std::vector<std::pair<std::string, size_t>> expected = { { "", 2 }, { "bar", 2 }, { "baz", 1 }, { "foo", 3 } };
+    ASSERT_EQ(expected, runs);
+}
+
+TEST(ska_partition, low_bits)
+{
+    std::mt19937_64 randomness(77342348);
+    std::uniform_int_distribution<uint32_t> distribution;
+    std::vector<uint32_t> to_partition(3000);
+    for (uint32_t & value : to_partition)
+        value = distribution(randomness);
+    std::vector<uint32_t> sorted_before = to_partition;
+    std::sort(sorted_before.begin(), sorted_before.end());
+    std::vector<size_t> boundaries = ska_partition(to_partition.begin(), to_partition.end(), 4, [](uint32_t i){ return i; });
+    ASSERT_EQ(17u, boundaries.size());
+    ASSERT_EQ(0u, boundaries.front());
+    ASSERT_EQ(to_partition.size(), boundaries.back());
+    for (size_t bucket = 0; bucket < 16; ++bucket)
+    {
+        for (size_t i = boundaries[bucket]; i < boundaries[bucket + 1]; ++i)
+            ASSERT_EQ(bucket, to_partition[i] & 15);
+    }
+    std::sort(to_partition.begin(), to_partition.end());
+    ASSERT_EQ(sorted_before, to_partition);
+}
+TEST(ska_partition, hash)
+{
+    std::vector<std::string> to_partition = { "foo", "bar", "baz", "hello", "world", "", "a", "b", "foo", "bar" };
+    std::hash<std::string> hasher;
+    std::vector<size_t> boundaries = ska_partition(to_partition.begin(), to_partition.end(), 10, [&](const std::string & s){ return hasher(s) >> 7; });
+    ASSERT_EQ(1025u, boundaries.size());
+    for (size_t bucket = 0; bucket < 1024; ++bucket)
+    {
+        for (size_t i = boundaries[bucket]; i < boundaries[bucket + 1]; ++i)
+            ASSERT_EQ(bucket, (hasher(to_partition[i]) >> 7) & 1023);
+    }
+}
+TEST(ska_partition_copy, high_bits)
+{
+    std::vector<uint16_t> to_partition = { 0xffff, 0x1234, 0x0001, 0x8000, 0x7fff, 0x1000, 0xf00f, 0x0000 };
+    std::vector<uint16_t> result(to_partition.size());
+    std::vector<size_t> boundaries = ska_partition_copy(to_partition.begin(), to_partition.end(), result.begin(), 2, [](uint16_t i){ return i >> 14; });
+    std::vector<size_t> expected_boundaries = { 0, 4, 5, 6, 8 };
+    ASSERT_EQ(expected_boundaries, boundaries);
+    std::vector<uint16_t> expected = { 0x1234, 0x0001, 0x1000, 0x0000, 0x7fff, 0x8000, 0xffff, 0xf00f };
+    ASSERT_EQ(expected, result);
+}
+
+template<typename Key, typename Value, typename Combine>
+static std::vector<std::pair<Key, Value>> group_aggregate_reference(std::vector<std::pair<Key, Value>> input, Combine combine)
+{
+    std::sort(input.begin(), input.end(), [](auto && l, auto && r){ return l.first < r.first; });
+    std::vector<std::pair<Key, Value>> result;
+    for (auto & kv : input)
+    {
+        if (!result.empty() && result.back().first == kv.first)
+            result.back().second = combine(result.back().second, kv.second);
+        else
+            result.push_back(kv);
+    }
+    return result;
+}
+
+TEST(ska_group_aggregate, sum)
+{
+    std::mt19937_64 randomness(77342348);
+    std::uniform_int_distribution<int> key_distribution(-5000, 5000);
+    std::uniform_int_distribution<int> value_distribution(0, 100);
+    std::vector<std::pair<int, int64_t>> input(50000);
+    for (auto & kv : input)
+        kv = { key_distribution(randomness), value_distribution(randomness) };
+    auto plus = [](int64_t l, int64_t r){ return l + r; };
+    auto expected = group_aggregate_reference(input, plus);
+    std::vector<std::pair<int, int64_t>> result;
+    ska_group_aggregate(input.begin(), input.end(), [](auto && kv){ return kv.first; }, [](auto && kv){ return kv.second; }, plus, std::back_inserter(result));
+    ASSERT_EQ(expected, result);
+}
+TEST(ska_group_aggregate, few_keys_min)
+{
+    std::mt19937_64 randomness(77342348);
+    std::uniform_int_distribution<int> key_distribution(0, 9);
+    std::uniform_real_distribution<double> value_distribution;
+    std::vector<std::pair<uint64_t, double>> input(20000);
+    for (auto & kv : input)
+        kv = { key_distribution(randomness) * 1000000007ull, value_distribution(randomness) };
+    auto min = [](double l, double r){ return std::min(l, r); };
+    auto expected = group_aggregate_reference(input, min);
+    std::vector<std::pair<uint64_t, double>> result;
+    ska_group_aggregate(input.begin(), input.end(), [](auto && kv){ return kv.first; }, [](auto && kv){ return kv.second; }, min, std::back_inserter(result));
+    ASSERT_EQ(expected, result);
+}
+TEST(ska_group_aggregate, skewed_keys)
+{
+    // one key is very common, the others are spread over many buckets
+    std::vector<std::pair<uint32_t, int>> input;
+    for (uint32_t i = 0; i < 30000; ++i)
+        input.emplace_back(i % 3 == 0 ? 7 : i * 2654435761u, 1);
+    auto plus = [](int l, int r){ return l + r; };
+    auto expected = group_aggregate_reference(input, plus);
+    std::vector<std::pair<uint32_t, int>> result;
+    ska_group_aggregate(input.begin(), input.end(), [](auto && kv){ return kv.first; }, [](auto && kv){ return kv.second; }, plus, std::back_inserter(result));
+    ASSERT_EQ(expected, result);
+}
+TEST(ska_group_aggregate, string_count)
+{
+    std::vector<std::string> input = { "foo", "bar", "foo", "", "baz", "bar", "", "foo" };
+    std::vector<std::pair<std::string, size_t>> result;
+    ska_group_aggregate(input.begin(), input.end(), [](const std::string & s) -> const std::string & { return s; }, [](const std::string &){ return size_t(1); }, [](size_t l, size_t r){ return l + r; }, std::back_inserter(result));
+    std::vector<std::pair<std::string, size_t>> expected = { { "", 2 }, { "bar", 2 }, { "baz", 1 }, { "foo", 3 } };
+    ASSERT_EQ(expected, result);
+}
+
+TEST(ska_build_csr, random_graph)
+{
+    std::mt19937_64 randomness(77342348);
+    static constexpr uint32_t num_vertices = 100;
+    std::uniform_int_distribution<uint32_t> vertex_distribution(0, num_vertices - 1);
+    std::vector<std::pair<uint32_t, uint32_t>> edges(5000);
+    for (auto & edge : edges)
+        edge = { vertex_distribution(randomness), vertex_distribution(randomness) };
+    std::vector<uint32_t> offsets(num_vertices + 1);
+    std::vector<uint32_t> targets(edges.size());
+    ska_build_csr(edges.begin(), edges.end(), num_vertices, offsets.begin(), targets.begin(), true);
+    std::vector<std::vector<uint32_t>> expected(num_vertices);
+    for (auto & edge : edges)
+        expected[edge.first].push_back(edge.second);
+    ASSERT_EQ(0u, offsets.front());
+    ASSERT_EQ(edges.size(), offsets.back());
+    for (uint32_t v = 0; v < num_vertices; ++v)
+    {
+        std::sort(expected[v].begin(), expected[v].end());
+        std::vector<uint32_t> row(targets.begin() + offsets[v], targets.begin() + offsets[v + 1]);
+        ASSERT_EQ(expected[v], row);
+    }
+}
+TEST(ska_build_csr, keeps_edge_order)
+{
+    struct Edge
+    {
+        int weight;
+        size_t to;
+        size_t from;
+    };
+    std::vector<Edge> edges = { { 1, 2, 3 }, { 2, 0, 0 }, { 3, 1, 3 }, { 4, 3, 0 }, { 5, 0, 3 } };
+    std::vector<size_t> offsets(5);
+    std::vector<size_t> targets(edges.size());
+    ska_build_csr(edges.begin(), edges.end(), 4, offsets.begin(), targets.begin(), [](const Edge & e){ return e.from; }, [](const Edge & e){ return e.to; });
+    std::vector<size_t> expected_offsets = { 0, 2, 2, 2, 5 };
+    std::vector<size_t> expected_targets = { 0, 3, 2, 1, 0 };
+    ASSERT_EQ(expected_offsets, offsets);
+    ASSERT_EQ(expected_targets, targets);
+}
+
+static std::vector<std::string> create_long_prefix_strings(std::mt19937_64 & randomness, size_t count)
+{
+    std::vector<std::string> prefixes = { "https://www.example.com/some/long/path/to/resources/", "https://www.example.com/some/long/path/to/other/", "/usr/local/share/documentation/" };
+    std::uniform_int_distribution<size_t> prefix_distribution(0, prefixes.size() - 1);
+    std::uniform_int_distribution<int> length_distribution(0, 40);
+    std::uniform_int_distribution<int> char_distribution('a', 'd');
+    std::vector<std::string> result;
+    for (size_t i = 0; i < count; ++i)
+    {
+        std::string to_add = prefixes[prefix_distribution(randomness)];
+        for (int j = length_distribution(randomness); j > 0; --j)
+            to_add += static_cast<char>(char_distribution(randomness));
+        result.push_back(std::move(to_add));
+    }
+    return result;
+}
+
+TEST(inplace_radix_sort, long_common_prefix)
+{
+    std::mt19937_64 randomness(41235);
+    std::vector<std::string> to_sort = create_long_prefix_strings(randomness, 2000);
+    std::vector<std::string> duplicates(to_sort.begin(), to_sort.begin() + 200);
+    to_sort.insert(to_sort.end(), duplicates.begin(), duplicates.end());
+    std::vector<std::string> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    inplace_radix_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+    std::shuffle(to_sort.begin(), to_sort.end(), randomness);
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(inplace_radix_sort, long_common_prefix_with_next_key)
+{
+    std::mt19937_64 randomness(9876);
+    std::vector<std::string> strings = create_long_prefix_strings(randomness, 300);
+    std::uniform_int_distribution<int> int_distribution(-5, 5);
+    std::vector<std::tuple<std::string, int>> to_sort;
+    for (int i = 0; i < 3; ++i)
+    {
+        for (const std::string & str : strings)
+            to_sort.emplace_back(str, int_distribution(randomness));
+    }
+    std::vector<std::tuple<std::string, int>> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    inplace_radix_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(inplace_radix_sort, long_common_prefix_int_lists)
+{
+    std::mt19937_64 randomness(5);
+    std::uniform_int_distribution<int> value_distribution(-3, 3);
+    std::uniform_int_distribution<int> length_distribution(0, 10);
+    std::vector<std::vector<int>> to_sort(1000, std::vector<int>(30, -7));
+    for (std::vector<int> & list : to_sort)
+    {
+        for (int i = length_distribution(randomness); i > 0; --i)
+            list.push_back(value_distribution(randomness));
+    }
+    std::vector<std::vector<int>> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    inplace_radix_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+
+TEST(ska_sort_burst, strings)
+{
+    std::mt19937_64 randomness(1234);
+    std::vector<std::string> to_sort = create_long_prefix_strings(randomness, 3000);
+    std::uniform_int_distribution<int> char_distribution(0, 255);
+    for (int i = 0; i < 1000; ++i)
+    {
+        std::string to_add(static_cast<size_t>(i % 7), 'x');
+        to_add += static_cast<char>(char_distribution(randomness));
+        to_sort.push_back(to_add);
+    }
+    to_sort.emplace_back();
+    to_sort.emplace_back();
+    std::shuffle(to_sort.begin(), to_sort.end(), randomness);
+    std::vector<std::string> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::string> small_buckets = to_sort;
+    detail::IdentityFunctor identity;
+    detail::burst_sort<16>(small_buckets.begin(), small_buckets.end(), identity);
+    ASSERT_EQ(sorted, small_buckets);
+    ska_sort_burst(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort_burst, c_strings)
+{
+    std::vector<const char *> to_sort = { "banana", "apple", "", "applesauce", "band", "\xff", "apple", "b" };
+    std::vector<const char *> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end(), [](const char * l, const char * r){ return std::strcmp(l, r) < 0; });
+    detail::IdentityFunctor identity;
+    detail::burst_sort<2>(to_sort.begin(), to_sort.end(), identity);
+    for (size_t i = 0; i < sorted.size(); ++i)
+        ASSERT_STREQ(sorted[i], to_sort[i]);
+}
+TEST(ska_sort_burst, deep_duplicates)
+{
+    std::vector<std::pair<std::string, int>> to_sort;
+    for (int i = 0; i < 100; ++i)
+    {
+        to_sort.emplace_back(std::string(300, 'a') + static_cast<char>('a' + i % 3), i);
+    }
+    auto extract_key = [](const std::pair<std::string, int> & p) -> const std::string & { return p.first; };
+    detail::burst_sort<4>(to_sort.begin(), to_sort.end(), extract_key);
+    for (size_t i = 1; i < to_sort.size(); ++i)
+        ASSERT_LE(to_sort[i - 1].first, to_sort[i].first);
+}
+#if __cplusplus >= 201703L
+TEST(ska_sort_burst, string_views)
+{
+    std::vector<std::string_view> to_sort = { "foo", "bar", "foobar", "", "baz", "fo" };
+    std::vector<std::string_view> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort_burst(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+#endif
+
+static std::vector<size_t> reference_lcp(const std::vector<std::string> & sorted)
+{
+    std::vector<size_t> result(sorted.size());
+    for (size_t i = 1; i < sorted.size(); ++i)
+    {
+        const std::string & l = sorted[i - 1];
+        const std::string & r = sorted[i];
+        size_t lcp = 0;
+        while (lcp < l.size() && lcp < r.size() && l[lcp] == r[lcp])
+            ++lcp;
+        result[i] = lcp;
+    }
+    return result;
+}
+
+TEST(ska_sort_lcp, strings)
+{
+    std::mt19937_64 randomness(5555);
+    std::vector<std::string> to_sort = create_long_prefix_strings(randomness, 3000);
+    for (int i = 0; i < 50; ++i)
+    {
+        to_sort.push_back(to_sort[i]);
+        to_sort.push_back(std::string(static_cast<size_t>(i), '\xff'));
+    }
+    to_sort.emplace_back();
+    to_sort.emplace_back();
+    std::shuffle(to_sort.begin(), to_sort.end(), randomness);
+    std::vector<std::string> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<size_t> lcp(to_sort.size(), 12345);
+    ska_sort_lcp(to_sort.begin(), to_sort.end(), lcp.begin());
+    ASSERT_EQ(sorted, to_sort);
+    ASSERT_EQ(reference_lcp(sorted), lcp);
+}
+TEST(ska_sort_lcp, key_and_c_strings)
+{
+    std::vector<std::pair<const char *, int>> to_sort = { { "foo", 0 }, { "foobar", 1 }, { "", 2 }, { "fob", 3 }, { "foo", 4 }, { "bar", 5 } };
+    std::vector<int> lcp(to_sort.size());
+    ska_sort_lcp(to_sort.begin(), to_sort.end(), lcp.begin(), [](const std::pair<const char *, int> & p){ return p.first; });
+    std::vector<std::string> sorted;
+    for (const std::pair<const char *, int> & p : to_sort)
+        sorted.push_back(p.first);
+    std::vector<std::string> expected = { "", "bar", "fob", "foo", "foo", "foobar" };
+    ASSERT_EQ(expected, sorted);
+    std::vector<int> expected_lcp = { 0, 0, 0, 2, 3, 3 };
+    ASSERT_EQ(expected_lcp, lcp);
+}
+
+TEST(ska_c_string, arena_strings)
+{
+    std::mt19937_64 randomness(424242);
+    std::vector<std::string> strings = create_long_prefix_strings(randomness, 2000);
+    for (int i = 0; i < 100; ++i)
+    {
+        strings.push_back(strings[i].substr(0, static_cast<size_t>(i)));
+        strings.push_back(strings[i]);
+    }
+    std::vector<char> arena;
+    std::vector<size_t> offsets;
+    for (const std::string & str : strings)
+    {
+        offsets.push_back(arena.size());
+        arena.insert(arena.end(), str.begin(), str.end());
+        arena.push_back('\0');
+    }
+    std::vector<const char *> to_sort;
+    for (size_t offset : offsets)
+        to_sort.push_back(arena.data() + offset);
+    std::sort(strings.begin(), strings.end());
+    auto as_c_string = [](const char * str){ return ska_c_string{ str }; };
+    inplace_radix_sort(to_sort.begin(), to_sort.end(), as_c_string);
+    ASSERT_EQ(strings, std::vector<std::string>(to_sort.begin(), to_sort.end()));
+    std::shuffle(to_sort.begin(), to_sort.end(), randomness);
+    ska_sort(to_sort.begin(), to_sort.end(), as_c_string);
+    ASSERT_EQ(strings, std::vector<std::string>(to_sort.begin(), to_sort.end()));
+}
+TEST(ska_c_string, with_second_key)
+{
+    std::vector<std::pair<const char *, int>> to_sort = { { "b", 2 }, { "a", 3 }, { "ab", 1 }, { "b", 1 }, { "", 4 }, { "a", 0 } };
+    inplace_radix_sort(to_sort.begin(), to_sort.end(), [](const std::pair<const char *, int> & p)
+    {
+        return std::make_pair(ska_c_string{ p.first }, p.second);
+    });
+    std::vector<std::pair<std::string, int>> sorted(to_sort.begin(), to_sort.end());
+    std::vector<std::pair<std::string, int>> expected = { { "", 4 }, { "a", 0 }, { "a", 3 }, { "ab", 1 }, { "b", 1 }, { "b", 2 } };
+    ASSERT_EQ(expected, sorted);
+}
+template<typename OffsetType>
+static void build_string_column(const std::vector<std::string> & strings, OffsetType first_offset, std::vector<OffsetType> & offsets, std::vector<char> & data)
+{
+    data.assign(static_cast<size_t>(first_offset), '?');
+    offsets.clear();
+    for (const std::string & str : strings)
+    {
+        offsets.push_back(static_cast<OffsetType>(data.size()));
+        data.insert(data.end(), str.begin(), str.end());
+    }
+    offsets.push_back(static_cast<OffsetType>(data.size()));
+}
+
+TEST(ska_sort_string_column, permutation)
+{
+    std::mt19937_64 randomness(35);
+    std::vector<std::string> strings = create_long_prefix_strings(randomness, 3000);
+    strings.emplace_back();
+    strings.push_back(strings.front());
+    std::vector<int32_t> offsets;
+    std::vector<char> data;
+    build_string_column(strings, int32_t(0), offsets, data);
+    std::vector<uint32_t> permutation(strings.size());
+    ska_sort_string_column(offsets.data(), data.data(), strings.size(), permutation.begin());
+    std::vector<std::string> sorted = strings;
+    std::sort(sorted.begin(), sorted.end());
+    for (size_t i = 0; i < sorted.size(); ++i)
+        ASSERT_EQ(sorted[i], strings[permutation[i]]);
+}
+TEST(ska_sort_string_column, copy_sliced_column)
+{
+    std::vector<std::string> strings = { "pear", "", "apple", "\xc3\xa9" "clair", "apple pie", "fig", "apple" };
+    std::vector<int64_t> offsets;
+    std::vector<char> data;
+    build_string_column(strings, int64_t(5), offsets, data);
+    std::vector<int64_t> out_offsets(offsets.size());
+    std::vector<char> out_data(data.size() - 5);
+    ska_sort_string_column_copy(offsets.data(), data.data(), strings.size(), out_offsets.data(), out_data.data());
+    std::vector<std::string> sorted = strings;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<int64_t> expected_offsets;
+    std::vector<char> expected_data;
+    build_string_column(sorted, int64_t(0), expected_offsets, expected_data);
+    ASSERT_EQ(expected_offsets, out_offsets);
+    ASSERT_EQ(expected_data, out_data);
+}
+static bool case_insensitive_less(const std::string & l, const std::string & r)
+{
+    auto fold = [](char c){ return c >= 'A' && c <= 'Z' ? static_cast<unsigned char>(c - 'A' + 'a') : static_cast<unsigned char>(c); };
+    std::string folded_l, folded_r;
+    std::transform(l.begin(), l.end(), std::back_inserter(folded_l), fold);
+    std::transform(r.begin(), r.end(), std::back_inserter(folded_r), fold);
+    return std::tie(folded_l, l) < std::tie(folded_r, r);
+}
+
+TEST(ska_sort_case_insensitive, mixed_case)
+{
+    std::mt19937_64 randomness(36);
+    std::vector<std::string> to_sort = create_long_prefix_strings(randomness, 2000);
+    std::uniform_int_distribution<int> coin(0, 1);
+    for (std::string & str : to_sort)
+    {
+        for (char & c : str)
+        {
+            if (c >= 'a' && c <= 'z' && coin(randomness))
+                c = static_cast<char>(c - 'a' + 'A');
+        }
+    }
+    std::vector<std::string> more = { "Zebra", "apple", "Apple", "APPLE", "\xc3\x89" "cole", "\xc3\xa9" "cole", "_", "[", "a_b", "A_B", "" };
+    to_sort.insert(to_sort.end(), more.begin(), more.end());
+    std::vector<std::string> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end(), &case_insensitive_less);
+    std::shuffle(to_sort.begin(), to_sort.end(), randomness);
+    ska_sort_case_insensitive(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort_mapped, byte_table)
+{
+    // sorts digits after letters
+    unsigned char table[256];
+    for (int i = 0; i < 256; ++i)
+        table[i] = static_cast<unsigned char>(i);
+    for (int i = '0'; i <= '9'; ++i)
+        table[i] = static_cast<unsigned char>(i - '0' + 'z' + 1);
+    std::vector<std::pair<std::string, int>> to_sort = { { "b2", 0 }, { "1a", 1 }, { "ab", 2 }, { "a1", 3 }, { "b", 4 }, { "10", 5 } };
+    ska_sort_mapped(to_sort.begin(), to_sort.end(), [](const std::pair<std::string, int> & p) -> const std::string & { return p.first; }, table);
+    std::vector<int> order;
+    for (const std::pair<std::string, int> & p : to_sort)
+        order.push_back(p.second);
+    std::vector<int> expected = { 2, 3, 4, 0, 1, 5 };
+    ASSERT_EQ(expected, order);
+}
+TEST(ska_sort_mapped, functor)
+{
+    std::vector<const char *> to_sort = { "b", "B", "a", "c", "A", "b" };
+    ska_sort_mapped(to_sort.begin(), to_sort.end(), detail::IdentityFunctor(), [](unsigned char c){ return static_cast<unsigned char>(255 - c); });
+    std::vector<std::string> sorted(to_sort.begin(), to_sort.end());
+    std::vector<std::string> expected = { "c", "b", "b", "a", "B", "A" };
+    ASSERT_EQ(expected, sorted);
+}
+template<size_t N>
+static std::vector<std::array<uint8_t, N>> create_digests(std::mt19937_64 & randomness, size_t count, size_t constant_prefix)
+{
+    std::uniform_int_distribution<int> byte_distribution(0, 255);
+    std::vector<std::array<uint8_t, N>> result(count);
+    for (std::array<uint8_t, N> & digest : result)
+    {
+        for (size_t i = 0; i < N; ++i)
+            digest[i] = i < constant_prefix ? 0x42 : static_cast<uint8_t>(byte_distribution(randomness));
+    }
+    for (size_t i = 0; i + 1 < count; i += 10)
+        result[i + 1] = result[i];
+    return result;
+}
+
+TEST(radix_sort, byte_array_digests)
+{
+    std::mt19937_64 randomness(37);
+    for (size_t constant_prefix : { 0, 6, 12 })
+    {
+        std::vector<std::array<uint8_t, 32>> to_sort = create_digests<32>(randomness, 1000, constant_prefix);
+        std::vector<std::array<uint8_t, 32>> result(to_sort.size());
+        bool which_buffer = radix_sort(to_sort.begin(), to_sort.end(), result.begin());
+        if (which_buffer)
+            std::sort(to_sort.begin(), to_sort.end());
+        else
+            std::sort(result.begin(), result.end());
+        ASSERT_EQ(result, to_sort);
+    }
+}
+TEST(inplace_radix_sort, byte_array_digests)
+{
+    std::mt19937_64 randomness(38);
+    for (size_t constant_prefix : { 0, 9, 19 })
+    {
+        std::vector<std::array<uint8_t, 20>> to_sort = create_digests<20>(randomness, 1000, constant_prefix);
+        std::vector<std::array<uint8_t, 20>> sorted = to_sort;
+        std::sort(sorted.begin(), sorted.end());
+        inplace_radix_sort(to_sort.begin(), to_sort.end());
+        ASSERT_EQ(sorted, to_sort);
+        std::shuffle(to_sort.begin(), to_sort.end(), randomness);
+        ska_sort(to_sort.begin(), to_sort.end());
+        ASSERT_EQ(sorted, to_sort);
+    }
+}
+TEST(ska_sort, char_array_member)
+{
+    struct Ticker
+    {
+        char symbol[12];
+        int id;
+    };
+    std::vector<std::string> symbols = { "MSFT", "AAPL", "GOOG", "AAPL", "IBM", "\xe9TF", "A", "", "ZZZZZZZZZZZ", "GOOGL" };
+    std::vector<Ticker> to_sort;
+    for (int i = 0; i < 200; ++i)
+    {
+        Ticker ticker = {};
+        std::memcpy(ticker.symbol, symbols[i % symbols.size()].data(), symbols[i % symbols.size()].size());
+        ticker.id = i;
+        to_sort.push_back(ticker);
+    }
+    auto symbol_key = [](const Ticker & ticker) -> const char (&)[12] { return ticker.symbol; };
+    inplace_radix_sort(to_sort.begin(), to_sort.end(), symbol_key);
+    for (size_t i = 1; i < to_sort.size(); ++i)
+        ASSERT_LE(std::memcmp(to_sort[i - 1].symbol, to_sort[i].symbol, 12), 0);
+    std::reverse(to_sort.begin(), to_sort.end());
+    ska_sort(to_sort.begin(), to_sort.end(), symbol_key);
+    for (size_t i = 1; i < to_sort.size(); ++i)
+        ASSERT_LE(std::memcmp(to_sort[i - 1].symbol, to_sort[i].symbol, 12), 0);
+}
+TEST(inplace_radix_sort, signed_char_array)
+{
+    std::vector<std::array<signed char, 3>> to_sort = { {{ 1, -1, 0 }}, {{ -128, 5, 5 }}, {{ 1, -2, 127 }}, {{ 0, 0, 0 }}, {{ 1, -1, -1 }}, {{ 127, 0, 0 }} };
+    std::vector<std::array<signed char, 3>> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    inplace_radix_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort, packed_pair_keys)
+{
+    static_assert(std::is_same<detail::SubKey<std::pair<uint16_t, uint32_t>>::sub_key_type, detail::PackedKeyBytes<6>>::value, "pair should get packed");
+    static_assert(std::is_same<detail::SubKey<std::pair<int32_t, float>>::sub_key_type, uint64_t>::value, "pair should get packed");
+    static_assert(detail::RadixSorter<std::pair<int16_t, int16_t>>::pass_count == detail::RadixSorter<uint32_t>::pass_count, "pair should get packed");
+    std::mt19937_64 randomness(38);
+    std::uniform_int_distribution<int> int_distribution(-300, 300);
+    std::vector<std::pair<int16_t, float>> to_sort;
+    for (int i = 0; i < 2000; ++i)
+        to_sort.emplace_back(static_cast<int16_t>(int_distribution(randomness)), static_cast<float>(int_distribution(randomness)) * 0.25f);
+    std::vector<std::pair<int16_t, float>> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::pair<int16_t, float>> copy = to_sort;
+    inplace_radix_sort(copy.begin(), copy.end());
+    ASSERT_EQ(sorted, copy);
+    copy = to_sort;
+    ska_sort(copy.begin(), copy.end());
+    ASSERT_EQ(sorted, copy);
+    std::vector<std::pair<int16_t, float>> buffer(to_sort.size());
+    if (radix_sort(to_sort.begin(), to_sort.end(), buffer.begin()))
+        ASSERT_EQ(sorted, buffer);
+    else
+        ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort, packed_tuple_keys)
+{
+    static_assert(std::is_same<detail::SubKey<std::tuple<uint8_t, int8_t, bool, uint32_t>>::sub_key_type, detail::PackedKeyBytes<7>>::value, "tuple should get packed");
+    static_assert(!detail::PackedKey<std::tuple<uint8_t, uint64_t>>::value, "tuple is too big to pack");
+    std::mt19937_64 randomness(39);
+    std::uniform_int_distribution<int> small_distribution(-3, 3);
+    std::uniform_int_distribution<uint32_t> big_distribution(0, 100);
+    std::vector<std::tuple<uint8_t, int8_t, bool, uint32_t>> to_sort;
+    for (int i = 0; i < 3000; ++i)
+    {
+        to_sort.emplace_back(static_cast<uint8_t>(small_distribution(randomness) + 3), static_cast<int8_t>(small_distribution(randomness)), small_distribution(randomness) > 0, big_distribution(randomness));
+    }
+    std::vector<std::tuple<uint8_t, int8_t, bool, uint32_t>> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::tuple<uint8_t, int8_t, bool, uint32_t>> copy = to_sort;
+    inplace_radix_sort(copy.begin(), copy.end());
+    ASSERT_EQ(sorted, copy);
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+    std::vector<std::tuple<uint8_t, int8_t, bool, uint32_t>> unique = sorted;
+    unique.erase(std::unique(unique.begin(), unique.end()), unique.end());
+    std::shuffle(copy.begin(), copy.end(), randomness);
+    copy.erase(ska_sort_unique(copy.begin(), copy.end()), copy.end());
+    ASSERT_EQ(unique, copy);
+}
+TEST(ska_encode_keys, composite_key)
+{
+    std::mt19937_64 randomness(39);
+    std::uniform_int_distribution<int> int_distribution(-5, 5);
+    std::vector<std::string> strings = { "", "a", std::string("a\0", 2), std::string("a\0b", 3), "ab", "b", std::string("\0", 1), "\xff" };
+    std::uniform_int_distribution<size_t> string_distribution(0, strings.size() - 1);
+    std::vector<std::tuple<int, double, std::string>> rows;
+    for (int i = 0; i < 2000; ++i)
+    {
+        rows.emplace_back(int_distribution(randomness), int_distribution(randomness) * 0.5, strings[string_distribution(randomness)]);
+    }
+    ska_encoded_keys keys = ska_encode_keys(rows.begin(), rows.end());
+    ASSERT_EQ(rows.size(), keys.size());
+    std::vector<size_t> permutation(rows.size());
+    ska_sort_encoded(keys, permutation.begin());
+    std::vector<size_t> expected(rows.size());
+    for (size_t i = 0; i < expected.size(); ++i)
+        expected[i] = i;
+    std::stable_sort(expected.begin(), expected.end(), [&](size_t l, size_t r){ return rows[l] < rows[r]; });
+    ASSERT_EQ(expected, permutation);
+}
+TEST(ska_encode_keys, range_lookup)
+{
+    std::vector<std::pair<std::string, uint16_t>> rows = { { "cherry", 3 }, { "apple", 7 }, { "banana", 1 }, { "apple", 2 }, { "cherry", 0 } };
+    ska_encoded_keys keys = ska_encode_keys(rows.begin(), rows.end());
+    std::vector<uint32_t> permutation(rows.size());
+    ska_sort_encoded(keys, permutation.begin());
+    std::vector<uint32_t> expected = { 3, 1, 2, 4, 0 };
+    ASSERT_EQ(expected, permutation);
+    std::vector<unsigned char> probe;
+    ska_encode_key(std::make_pair(std::string("banana"), uint16_t(0)), probe);
+    auto lower = std::lower_bound(permutation.begin(), permutation.end(), probe, [&](uint32_t row, const std::vector<unsigned char> & search)
+    {
+        return std::lexicographical_compare(keys.key_data(row), keys.key_data(row) + keys.key_size(row), search.begin(), search.end());
+    });
+    ASSERT_EQ(2, lower - permutation.begin());
+}
+TEST(ska_sort_materialized, calls_key_once)
+{
+    struct Record
+    {
+        double value;
+        std::array<int, 8> payload;
+    };
+    std::mt19937_64 randomness(40);
+    std::uniform_real_distribution<double> value_distribution(-1000.0, 1000.0);
+    std::vector<Record> to_sort(5000);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+    {
+        to_sort[i].value = i % 7 == 0 ? 1.5 : value_distribution(randomness);
+        to_sort[i].payload.fill(static_cast<int>(i));
+    }
+    std::vector<double> sorted_values;
+    for (const Record & record : to_sort)
+        sorted_values.push_back(record.value);
+    std::sort(sorted_values.begin(), sorted_values.end());
+    size_t num_calls = 0;
+    ska_sort_materialized(to_sort.begin(), to_sort.end(), [&](const Record & record)
+    {
+        ++num_calls;
+        return record.value;
+    });
+    ASSERT_EQ(to_sort.size(), num_calls);
+    std::vector<bool> seen(to_sort.size());
+    for (size_t i = 0; i < to_sort.size(); ++i)
+    {
+        ASSERT_EQ(sorted_values[i], to_sort[i].value);
+        size_t original_index = static_cast<size_t>(to_sort[i].payload[0]);
+        ASSERT_FALSE(seen[original_index]);
+        seen[original_index] = true;
+    }
+}
+TEST(ska_sort_materialized, pair_and_string_keys)
+{
+    std::vector<std::pair<int16_t, uint8_t>> pairs = { { 5, 1 }, { -3, 2 }, { 5, 0 }, { 0, 9 }, { -3, 1 } };
+    std::vector<std::pair<int16_t, uint8_t>> sorted_pairs = pairs;
+    std::sort(sorted_pairs.begin(), sorted_pairs.end());
+    ska_sort_materialized(pairs.begin(), pairs.end());
+    ASSERT_EQ(sorted_pairs, pairs);
+    std::vector<std::string> strings = { "b", "a", "c", "" };
+    ska_sort_materialized(strings.begin(), strings.end());
+    std::vector<std::string> sorted_strings = { "", "a", "b", "c" };
+    ASSERT_EQ(sorted_strings, strings);
+}
+TEST(ska_sort_copy_managed, large_buffer)
+{
+    std::mt19937_64 randomness(41);
+    std::uniform_int_distribution<uint32_t> distribution;
+    std::vector<uint32_t> to_sort(1000000);
+    for (uint32_t & value : to_sort)
+        value = distribution(randomness);
+    std::vector<uint32_t> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort_copy_managed(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort_copy_managed, non_trivial_elements)
+{
+    std::vector<std::pair<uint16_t, std::string>> to_sort;
+    std::vector<std::pair<uint16_t, std::string>> expected(1000);
+    for (int i = 0; i < 1000; ++i)
+    {
+        uint16_t key = static_cast<uint16_t>((i * 7919) % 1000);
+        to_sort.emplace_back(key, std::to_string(i));
+        expected[key] = to_sort.back();
+    }
+    ska_sort_copy_managed(to_sort.begin(), to_sort.end(), [](const std::pair<uint16_t, std::string> & p){ return p.first; });
+    ASSERT_EQ(expected, to_sort);
+}
+TEST(ska_sort_copy, hybrid_uint64)
+{
+    std::mt19937_64 randomness(42);
+    std::vector<uint64_t> to_sort(1000000);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+    {
+        // half of the keys share their top bytes, so that the top level
+        // has to skip bytes and split a big bucket a second time
+        uint64_t value = randomness();
+        to_sort[i] = i % 2 ? value : (0x1234ull << 48) | (value >> 40);
+    }
+    std::vector<uint64_t> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<uint64_t> buffer(to_sort.size());
+    if (ska_sort_copy(to_sort.begin(), to_sort.end(), buffer.begin()))
+        ASSERT_EQ(sorted, buffer);
+    else
+        ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort_copy, hybrid_double)
+{
+    std::mt19937_64 randomness(42);
+    std::uniform_real_distribution<double> distribution(-1000.0, 1000.0);
+    std::vector<double> to_sort(100000);
+    for (double & value : to_sort)
+        value = distribution(randomness);
+    std::vector<double> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort_copy_managed(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort_copy, hybrid_large_pair)
+{
+    std::mt19937_64 randomness(42);
+    std::vector<std::pair<uint64_t, uint32_t>> to_sort(200000);
+    for (std::pair<uint64_t, uint32_t> & value : to_sort)
+        value = { randomness() % 1000, static_cast<uint32_t>(randomness()) };
+    std::vector<std::pair<uint64_t, uint32_t>> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<std::pair<uint64_t, uint32_t>> buffer(to_sort.size());
+    if (ska_sort_copy(to_sort.begin(), to_sort.end(), buffer.begin()))
+        ASSERT_EQ(sorted, buffer);
+    else
+        ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort, wide_first_digit)
+{
+    // big enough that the top level splits by eleven bits at once
+    std::mt19937_64 randomness(43);
+    std::vector<uint64_t> to_sort(1 << 23);
+    for (uint64_t & value : to_sort)
+        value = randomness();
+    std::vector<uint64_t> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort, wide_first_digit_two_byte_key)
+{
+    // big elements with a two byte key, so that the wide digit ends in the
+    // middle of the last byte
+    struct BigElement
+    {
+        uint16_t key;
+        uint32_t index;
+        unsigned char payload[56];
+    };
+    std::mt19937_64 randomness(43);
+    std::vector<BigElement> to_sort(1 << 20);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+    {
+        to_sort[i].key = static_cast<uint16_t>(randomness());
+        to_sort[i].index = static_cast<uint32_t>(i);
+    }
+    ska_sort(to_sort.begin(), to_sort.end(), [](const BigElement & element){ return element.key; });
+    ASSERT_TRUE(std::is_sorted(to_sort.begin(), to_sort.end(), [](const BigElement & l, const BigElement & r){ return l.key < r.key; }));
+    std::vector<bool> seen(to_sort.size());
+    for (const BigElement & element : to_sort)
+        seen[element.index] = true;
+    ASSERT_EQ(to_sort.size(), static_cast<size_t>(std::count(seen.begin(), seen.end(), true)));
+}
+TEST(ska_sort, block_partition)
+{
+    // big enough for the block based partitioning. most keys fall into a
+    // few partitions, and the rest are spread out so that many partitions
+    // are smaller than a block
+    std::mt19937_64 randomness(44);
+    std::vector<uint64_t> to_sort(1 << 20);
+    for (uint64_t & value : to_sort)
+    {
+        value = randomness();
+        if (value % 8 != 0)
+            value = (value % 3) << 56 | (value >> 8);
+    }
+    std::vector<uint64_t> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort, block_partition_big_elements)
+{
+    struct BigElement
+    {
+        uint32_t key;
+        uint32_t index;
+        unsigned char payload[1016];
+    };
+    std::mt19937_64 randomness(44);
+    std::vector<BigElement> to_sort(8192);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+    {
+        to_sort[i].key = static_cast<uint32_t>(randomness());
+        to_sort[i].index = static_cast<uint32_t>(i);
+    }
+    std::vector<std::pair<uint32_t, uint32_t>> expected;
+    for (const BigElement & element : to_sort)
+        expected.emplace_back(element.key, element.index);
+    std::sort(expected.begin(), expected.end());
+    ska_sort(to_sort.begin(), to_sort.end(), [](const BigElement & element){ return std::make_pair(element.key, element.index); });
+    std::vector<std::pair<uint32_t, uint32_t>> result;
+    for (const BigElement & element : to_sort)
+        result.emplace_back(element.key, element.index);
+    ASSERT_EQ(expected, result);
+}
+TEST(ska_sort, block_partition_deque)
+{
+    std::mt19937_64 randomness(44);
+    std::deque<uint32_t> to_sort(1 << 21);
+    for (uint32_t & value : to_sort)
+        value = static_cast<uint32_t>(randomness());
+    std::vector<uint32_t> sorted(to_sort.begin(), to_sort.end());
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_TRUE(std::equal(sorted.begin(), sorted.end(), to_sort.begin()));
+}
+TEST(ska_sort, fused_next_histogram)
+{
+    // big enough that the top level counts the second byte while it swaps,
+    // but too small for the block partitioning
+    std::mt19937_64 randomness(45);
+    std::vector<uint16_t> to_sort(1 << 20);
+    for (uint16_t & value : to_sort)
+        value = static_cast<uint16_t>(randomness() % 3 == 0 ? randomness() : randomness() % 512);
+    std::vector<uint16_t> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_sort, fused_next_histogram_non_trivial)
+{
+    std::mt19937_64 randomness(45);
+    std::vector<std::pair<uint32_t, std::string>> to_sort(1 << 20);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+        to_sort[i] = { static_cast<uint32_t>(randomness()), std::to_string(i) };
+    std::vector<std::pair<uint32_t, std::string>> sorted = to_sort;
+    std::stable_sort(sorted.begin(), sorted.end(), [](const std::pair<uint32_t, std::string> & l, const std::pair<uint32_t, std::string> & r){ return l.first < r.first; });
+    ska_sort(to_sort.begin(), to_sort.end(), [](const std::pair<uint32_t, std::string> & p){ return p.first; });
+    for (size_t i = 0; i < to_sort.size(); ++i)
+        ASSERT_EQ(sorted[i].first, to_sort[i].first);
+}
+TEST(ska_segmented_sort, mixed_sizes)
+{
+    std::mt19937_64 randomness(47);
+    std::vector<uint32_t> offsets = { 0 };
+    while (offsets.back() < 500000)
+    {
+        uint32_t size = randomness() % 4 == 0 ? randomness() % 2000 : randomness() % 40;
+        offsets.push_back(offsets.back() + size);
+    }
+    std::vector<uint32_t> to_sort(offsets.back());
+    for (uint32_t & value : to_sort)
+        value = static_cast<uint32_t>(randomness());
+    std::vector<uint32_t> sorted = to_sort;
+    for (size_t i = 0; i + 1 < offsets.size(); ++i)
+        std::sort(sorted.begin() + offsets[i], sorted.begin() + offsets[i + 1]);
+    ska_segmented_sort(to_sort.begin(), offsets.begin(), offsets.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_segmented_sort, small_segments_float)
+{
+    std::mt19937_64 randomness(47);
+    std::vector<size_t> offsets = { 0 };
+    while (offsets.back() < 100000)
+        offsets.push_back(offsets.back() + randomness() % 64);
+    std::vector<float> to_sort(offsets.back());
+    std::uniform_real_distribution<float> distribution(-100.0f, 100.0f);
+    for (float & value : to_sort)
+        value = distribution(randomness);
+    std::vector<float> sorted = to_sort;
+    for (size_t i = 0; i + 1 < offsets.size(); ++i)
+        std::sort(sorted.begin() + offsets[i], sorted.begin() + offsets[i + 1]);
+    ska_segmented_sort(to_sort.begin(), offsets.begin(), offsets.end());
+    ASSERT_EQ(sorted, to_sort);
+}
+TEST(ska_segmented_sort, custom_key)
+{
+    std::mt19937_64 randomness(47);
+    std::vector<int> offsets = { 0 };
+    while (offsets.back() < 100000)
+        offsets.push_back(offsets.back() + static_cast<int>(randomness() % 300));
+    std::vector<std::pair<uint64_t, std::string>> to_sort(offsets.back());
+    for (auto & value : to_sort)
+        value.first = randomness() % 1000;
+    auto by_first = [](const std::pair<uint64_t, std::string> & l, const std::pair<uint64_t, std::string> & r){ return l.first < r.first; };
+    std::vector<std::pair<uint64_t, std::string>> sorted = to_sort;
+    for (size_t i = 0; i + 1 < offsets.size(); ++i)
+        std::sort(sorted.begin() + offsets[i], sorted.begin() + offsets[i + 1], by_first);
+    ska_segmented_sort(to_sort.begin(), offsets.begin(), offsets.end(), [](const std::pair<uint64_t, std::string> & p){ return p.first; });
+    for (size_t i = 0; i < to_sort.size(); ++i)
+        ASSERT_EQ(sorted[i].first, to_sort[i].first);
+}
+TEST(ska_sort_list, list)
+{
+    std::mt19937_64 randomness(48);
+    std::list<int64_t> to_sort;
+    for (int i = 0; i < 100000; ++i)
+        to_sort.push_back(static_cast<int64_t>(randomness()) >> (randomness() % 64));
+    std::vector<int64_t> sorted(to_sort.begin(), to_sort.end());
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort_list(to_sort);
+    ASSERT_TRUE(std::equal(sorted.begin(), sorted.end(), to_sort.begin()));
+}
+TEST(ska_sort_list, forward_list_stable)
+{
+    std::mt19937_64 randomness(48);
+    std::forward_list<std::pair<uint16_t, int>> to_sort;
+    for (int i = 0; i < 100000; ++i)
+        to_sort.emplace_front(static_cast<uint16_t>(randomness() % 3000), i);
+    std::vector<std::pair<uint16_t, int>> sorted(to_sort.begin(), to_sort.end());
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto & l, auto & r){ return l.first < r.first; });
+    ska_sort_list(to_sort, [](const std::pair<uint16_t, int> & p){ return p.first; });
+    ASSERT_TRUE(std::equal(sorted.begin(), sorted.end(), to_sort.begin()));
+}
+TEST(ska_sort_list, non_movable_strings)
+{
+    struct NonMovable
+    {
+        explicit NonMovable(std::string s)
+            : s(std::move(s))
+        {
+        }
+        NonMovable(const NonMovable &) = delete;
+        NonMovable & operator=(const NonMovable &) = delete;
+        std::string s;
+    };
+    std::mt19937_64 randomness(48);
+    std::list<NonMovable> to_sort;
+    std::vector<std::string> sorted;
+    for (int i = 0; i < 5000; ++i)
+    {
+        sorted.push_back(std::to_string(randomness() % 1000));
+        to_sort.emplace_back(sorted.back());
+    }
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort_list(to_sort, [](const NonMovable & x) -> const std::string & { return x.s; });
+    ASSERT_TRUE(std::equal(sorted.begin(), sorted.end(), to_sort.begin(), [](const std::string & l, const NonMovable & r){ return l == r.s; }));
+}
+TEST(ska_sort_linked_list, intrusive)
+{
+    struct Node
+    {
+        uint32_t key;
+        size_t index;
+        Node * next;
+    };
+    std::mt19937_64 randomness(48);
+    std::vector<Node> nodes(200000);
+    for (size_t i = 0; i < nodes.size(); ++i)
+        nodes[i] = { static_cast<uint32_t>(randomness() % 100000), i, i + 1 < nodes.size() ? &nodes[i + 1] : nullptr };
+    Node * head = ska_sort_linked_list(&nodes[0], [](Node & node) -> Node *& { return node.next; }, [](const Node & node){ return node.key; });
+    size_t num_nodes = 0;
+    for (Node * node = head; node; node = node->next, ++num_nodes)
+    {
+        if (node->next)
+        {
+            ASSERT_TRUE(std::make_pair(node->key, node->index) < std::make_pair(node->next->key, node->next->index));
+        }
+    }
+    ASSERT_EQ(nodes.size(), num_nodes);
+}
+TEST(ska_sort, deque_chunks)
+{
+#ifdef __GLIBCXX__
+    static_assert(ska_chunked_iterator<std::deque<uint64_t>::iterator>::value, "std::deque should get sorted through its arrays");
+#endif
+    std::mt19937_64 randomness(49);
+    std::deque<uint64_t> to_sort(300000);
+    for (uint64_t & value : to_sort)
+        value = randomness() >> (randomness() % 64);
+    // start and end in the middle of an array
+    auto begin = to_sort.begin() + 37;
+    auto end = to_sort.end() - 11;
+    std::vector<uint64_t> sorted(to_sort.begin(), to_sort.end());
+    std::sort(sorted.begin() + 37, sorted.end() - 11);
+    ska_sort(begin, end);
+    ASSERT_TRUE(std::equal(sorted.begin(), sorted.end(), to_sort.begin()));
+}
+TEST(ska_sort, deque_chunks_non_trivial)
+{
+    std::mt19937_64 randomness(49);
+    std::deque<std::pair<uint16_t, std::string>> to_sort(50000);
+    for (size_t i = 0; i < to_sort.size(); ++i)
+        to_sort[i] = { static_cast<uint16_t>(randomness()), std::to_string(i) };
+    std::vector<std::pair<uint16_t, std::string>> sorted(to_sort.begin(), to_sort.end());
+    std::sort(sorted.begin(), sorted.end());
+    ska_sort(to_sort.begin(), to_sort.end());
+    ASSERT_TRUE(std::equal(sorted.begin(), sorted.end(), to_sort.begin()));
+}
+TEST(ska_sort_into, leaves_input_alone)
+{
+    std::mt19937_64 randomness(50);
+    // one, two and four bytes that differ give an odd and an even number
+    // of passes, and both have to end up in the output
+    for (uint32_t mask : { 0xffu, 0xffffu, 0xffffffffu })
+    {
+        std::vector<uint32_t> input(100000);
+        for (uint32_t & value : input)
+            value = static_cast<uint32_t>(randomness()) & mask;
+        const std::vector<uint32_t> original = input;
+        std::vector<uint32_t> sorted = input;
+        std::sort(sorted.begin(), sorted.end());
+        std::vector<uint32_t> output(input.size());
+        ska_sort_into(input.cbegin(), input.cend(), output.begin());
+        ASSERT_EQ(sorted, output);
+        ASSERT_EQ(original, input);
+    }
+}
+TEST(ska_sort_into, hybrid_uint64)
+{
+    std::mt19937_64 randomness(50);
+    std::vector<uint64_t> input(1 << 20);
+    for (uint64_t & value : input)
+        value = randomness();
+    const std::vector<uint64_t> original = input;
+    std::vector<uint64_t> sorted = input;
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<uint64_t> output(input.size());
+    ska_sort_into(input.begin(), input.end(), output.begin());
+    ASSERT_EQ(sorted, output);
+    ASSERT_EQ(original, input);
+}
+TEST(ska_sort_into, strings)
+{
+    std::mt19937_64 randomness(50);
+    std::vector<std::pair<float, std::string>> input(10000);
+    for (size_t i = 0; i < input.size(); ++i)
+        input[i] = { static_cast<float>(randomness() % 100) - 50.0f, std::to_string(randomness() % 1000) };
+    const std::vector<std::pair<float, std::string>> original = input;
+    std::vector<std::pair<float, std::string>> sorted = input;
+    std::sort(sorted.begin(), sorted.end(), [](auto & l, auto & r){ return l.second < r.second; });
+    std::vector<std::pair<float, std::string>> by_string(input.size());
+    ska_sort_into(input.begin(), input.end(), by_string.begin(), [](const std::pair<float, std::string> & p) -> const std::string & { return p.second; });
+    for (size_t i = 0; i < input.size(); ++i)
+        ASSERT_EQ(sorted[i].second, by_string[i].second);
+    std::stable_sort(sorted.begin(), sorted.end(), [](auto & l, auto & r){ return l.first < r.first; });
+    std::vector<std::pair<float, std::string>> by_float(input.size());
+    ska_sort_into(input.begin(), input.end(), by_float.begin(), [](const std::pair<float, std::string> & p){ return p.first; });
+    for (size_t i = 0; i < input.size(); ++i)
+        ASSERT_EQ(sorted[i].first, by_float[i].first);
+    ASSERT_EQ(original, input);
+}
+#if __cplusplus >= 201703L
+TEST(ska_encode_keys, optional)
+{
+    std::vector<std::optional<int>> rows = { 5, std::nullopt, -3, std::nullopt, 0 };
+    ska_encoded_keys keys = ska_encode_keys(rows.begin(), rows.end());
+    std::vector<size_t> permutation(rows.size());
+    ska_sort_encoded(keys, permutation.begin());
+    std::vector<size_t> expected = { 1, 3, 2, 4, 0 };
+    ASSERT_EQ(expected, permutation);
+}
+#endif
+#if __cplusplus >= 201703L
+TEST(inplace_radix_sort, string_view_key_by_value)
+{
+    std::mt19937_64 randomness(8);
+    std::vector<std::string> to_sort = create_long_prefix_strings(randomness, 1000);
+    std::vector<std::string> sorted = to_sort;
+    std::sort(sorted.begin(), sorted.end());
+    inplace_radix_sort(to_sort.begin(), to_sort.end(), [](const std::string & str){ return std::string_view(str); });
+    ASSERT_EQ(sorted, to_sort);
+}
+#endif
+
 #endif
 
 // benchmarks
@@ -1096,6 +2276,26 @@ static std::vector<std::string> SKA_SORT_NOINLINE create_radix_sort_data(std::mt
     return result;
 }
 
+#elif 0
+// deep recursion: every level only has a few small partitions
+// size_t counts in every level
+//benchmark_ska_sort/512k      174563000 ns
+// 16 bit counts in american flag sort, 32 bit counts in ska_byte_sort
+//benchmark_ska_sort/512k      154620000 ns
+static std::vector<std::string> SKA_SORT_NOINLINE create_radix_sort_data(std::mt19937_64 & randomness, int size)
+{
+    std::vector<std::string> result;
+    result.reserve(size);
+    std::uniform_int_distribution<char> string_content_distribution('a', 'd');
+    for (int i = 0; i < size; ++i)
+    {
+        std::string to_add = "common_prefix_";
+        for (int i = 0; i < 12; ++i)
+            to_add.push_back(string_content_distribution(randomness));
+        result.push_back(std::move(to_add));
+    }
+    return result;
+}
 #elif 1
 
 extern const std::vector<const char *> & get_word_list();
@@ -1243,6 +2443,25 @@ static void benchmark_ska_sort_copy(benchmark::State & state)
 BENCHMARK(benchmark_ska_sort_copy)->RangeMultiplier(profile_multiplier)->Range(profile_multiplier, max_profile_range);
 #endif
 
+#if 0
+static void benchmark_ska_sort_copy_managed(benchmark::State & state)
+{
+    std::mt19937_64 randomness(77342348);
+    while (state.KeepRunning())
+    {
+        auto to_sort = create_radix_sort_data(randomness, state.range(0));
+#ifdef SORT_ON_FIRST_ONLY
+        ska_sort_copy_managed(to_sort.begin(), to_sort.end(), [](auto && a) -> decltype(auto){ return std::get<0>(a); });
+#else
+        ska_sort_copy_managed(to_sort.begin(), to_sort.end());
+        assert(std::is_sorted(to_sort.begin(), to_sort.end()));
+#endif
+        benchmark::DoNotOptimize(to_sort.data());
+    }
+}
+BENCHMARK(benchmark_ska_sort_copy_managed)->RangeMultiplier(profile_multiplier)->Range(profile_multiplier, max_profile_range);
+#endif
+
 #if 1
 
 static void benchmark_std_sort(benchmark::State & state)